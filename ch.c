@@ -27,6 +27,34 @@
 #endif
 #endif
 
+#if HAVE_MMAP && HAVE_SYS_MMAN_H && HAVE_STAT && !MSDOS_COMPILER
+#define USE_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef MAP_FAILED
+#define MAP_FAILED      ((void *) -1)
+#endif
+#else
+#define USE_MMAP 0
+#endif
+
+#if HAVE_READV && HAVE_SYS_UIO_H
+#define USE_READV 1
+#include <sys/uio.h>
+#else
+#define USE_READV 0
+#endif
+
+#if HAVE_STAT_INO
+#include <sys/stat.h>
+#endif
+
+#if HAVE_POSIX_FADVISE && defined(POSIX_FADV_WILLNEED)
+#define USE_FADVISE 1
+#else
+#define USE_FADVISE 0
+#endif
+
 typedef POSITION BLOCKNUM;
 
 public int ignore_eoi;
@@ -42,23 +70,103 @@ struct bufnode {
 	struct bufnode *hnext, *hprev;
 };
 
-#define LBUFSIZE        8192
+/*
+ * Each buffer holds one block of the file.
+ * The size of a block is chosen (by the --block-size option)
+ * when the file's state is created, and the data area is allocated
+ * along with the buffer itself.
+ */
+#define LBUFSIZE        8192    /* Default block size */
 struct buf {
 	struct bufnode node;
 	BLOCKNUM block;
 	unsigned int datasize;
-	unsigned char data[LBUFSIZE];
+	unsigned char *data;
 };
 #define bufnode_buf(bn)  ((struct buf *) bn)
 
+#if USE_READV
+/*
+ * In adaptive mode (--block-size=0), a sequential scan through
+ * a seekable file reads up to MAXREADBLKS blocks with one system call.
+ */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define MAXREADBLKS     IOV_MAX
+#else
+#define MAXREADBLKS     64
+#endif
+#endif
+
+#if USE_MMAP
+/*
+ * A regular file is read through a window of the file mapped into
+ * memory, rather than by copying it into the buffer pool.
+ * The window is a fixed-size aligned region of the file, so a huge
+ * file never needs to be mapped all at once (which might not even be
+ * possible on a 32-bit system).
+ * Data beyond the size of the file at the time it was mapped
+ * (for example, data appended while following the file)
+ * is still read into the buffer pool.
+ */
+#define MAPWIN_SIZE     ((size_t) ((sizeof(char*) >= 8) ? (64*1024*1024) : (8*1024*1024)))
+#endif
+
+/*
+ * When the read pointer moves through at least SEQ_MIN_BLOCKS adjacent
+ * blocks in the same direction, we ask the system to read ahead
+ * READAHEAD_SIZE bytes in that direction.  The system does its own
+ * readahead for forward reads, but not for backward reads 
+ * (for example, a backward search), which matter on slow disks.
+ * Once a sequential scan has covered SCAN_SIZE bytes, data which 
+ * we discard behind the scan is also dropped from the system cache,
+ * so scanning a huge file doesn't push everything else out of memory.
+ */
+#define SEQ_MIN_BLOCKS  4
+#define READAHEAD_SIZE  ((POSITION) (2*1024*1024))
+#define SCAN_SIZE       ((POSITION) (16*1024*1024))
+
+/*
+ * In cold mode (see ch_coldinit), data is dropped from the system cache
+ * as soon as it has been read.  The system may cache a file in pieces
+ * larger than a block, which cannot be dropped until all of each piece
+ * has been read, so we also drop anything cached up to COLD_DROP_SIZE
+ * bytes behind the data just read, in the direction of the scan.
+ */
+#define COLD_DROP_SIZE  ((POSITION) (8*1024*1024))
+
+/*
+ * While following a regular file which can be watched for changes
+ * (see follow_watch), we wait for a change rather than sleeping.
+ * We still look at the file every FOLLOW_WAIT_MS milliseconds,
+ * in case it is changed in a way the system doesn't report
+ * (for example, by another host on a network file system).
+ */
+#define FOLLOW_WAIT_MS  1000
+
+/*
+ * Buffers are found by block number in a hash table of 
+ * hashsize chains, where hashsize is a power of two.
+ * The table starts with BUFHASH_SIZE chains and doubles whenever 
+ * there are more buffers than chains, so the average chain stays 
+ * short however large -b allows the buffer pool to grow.
+ */
+#define BUFHASH_SIZE    64
+
+/*
+ * When a file whose buffers were kept is opened again after it has
+ * grown, the last CH_SUM_LEN bytes it had before are checked.
+ */
+#define CH_SUM_LEN      4096
+
 /*
  * The file state is maintained in a filestate structure.
  * A pointer to the filestate is kept in the ifile structure.
  */
-#define BUFHASH_SIZE    1024
 struct filestate {
+	struct filestate *fsnext, *fsprev;
 	struct bufnode buflist;
-	struct bufnode hashtbl[BUFHASH_SIZE];
+	struct bufnode *hashtbl; /* Array of hashsize hash chains */
+	int hashsize;
 	int file;
 	int flags;
 	POSITION fpos;
@@ -66,6 +174,30 @@ struct filestate {
 	BLOCKNUM block;
 	unsigned int offset;
 	POSITION fsize;
+	unsigned int blksize;    /* Size of each block */
+	int maxreadblks;         /* Max blocks to read at once */
+	int nreadblks;           /* Blocks to read at once in a sequential scan */
+	BLOCKNUM lastread;       /* Last block read from the file */
+	BLOCKNUM seqblock;       /* Last block moved into by ch_forw/back_get */
+	int seqdir;              /* Direction of sequential access: 1 or -1 */
+	int seqcount;            /* Adjacent blocks moved through in seqdir */
+	POSITION rapos;          /* Readahead has been requested up to here */
+	int spoolfd;             /* Spool file for a pipe, or -1 */
+	POSITION spoolpos;       /* Data before here is in the spool file */
+#if HAVE_STAT_INO
+	int haveid;              /* Is dev/ino valid? */
+	dev_t dev;               /* Device of the file in the buffers */
+	ino_t ino;               /* I-number of the file in the buffers */
+	POSITION closesize;      /* Size of the file when closed, or NULL_POSITION */
+	time_t closemtime;       /* Modification time of the file when closed */
+	unsigned long closesum;  /* Checksum of the data before closesize */
+#endif
+#if USE_MMAP
+	unsigned char *mapaddr;  /* Start of mapped window, or NULL */
+	POSITION mappos;         /* File position of mapaddr */
+	size_t maplen;           /* Length of mapped window */
+	POSITION mapsize;        /* Only data before here is mapped */
+#endif
 };
 
 #define ch_bufhead      thisfile->buflist.next
@@ -77,10 +209,11 @@ struct filestate {
 #define ch_fsize        thisfile->fsize
 #define ch_flags        thisfile->flags
 #define ch_file         thisfile->file
+#define ch_blksize      thisfile->blksize
 
 #define END_OF_CHAIN    (&thisfile->buflist)
 #define END_OF_HCHAIN(h) (&thisfile->hashtbl[h])
-#define BUFHASH(blk)    ((blk) & (BUFHASH_SIZE-1))
+#define BUFHASH(blk)    ((int) ((blk) & (thisfile->hashsize-1)))
 
 /*
  * Macros to manipulate the list of buffers in thisfile->buflist.
@@ -122,10 +255,37 @@ struct filestate {
 	thisfile->hashtbl[h].hnext = (bn);
 
 static struct filestate *thisfile;
+
+/*
+ * All filestates are kept on a list, 
+ * in order from most- to least-recently used.
+ * With --total-buffers, the buffers of all files share one budget,
+ * and a file that needs more buffers reclaims them first from
+ * the files which were used least recently.
+ */
+static struct filestate fslist = { &fslist, &fslist };
+static POSITION totbufbytes = 0;
+
+#define FS_RM(fs) \
+	(fs)->fsnext->fsprev = (fs)->fsprev; \
+	(fs)->fsprev->fsnext = (fs)->fsnext;
+
+#define FS_INS_HEAD(fs) \
+	(fs)->fsnext = fslist.fsnext; \
+	(fs)->fsprev = &fslist; \
+	fslist.fsnext->fsprev = (fs); \
+	fslist.fsnext = (fs);
 static int ch_ungotchar = -1;
-static int maxbufs = -1;
+static int maxbufspace = -1;
+#if USE_MMAP
+static volatile int map_faulted = FALSE;
+#endif
 
 extern int autobuf;
+extern int block_size;
+extern int use_spool;
+extern int total_bufspace;
+extern int cold_read;
 extern int sigs;
 extern int secure;
 extern int screen_trashed;
@@ -140,7 +300,602 @@ extern char *namelogfile;
 #endif
 
 static int ch_addbuf();
+static void ch_reset(int keep);
+static void ch_growhash(void);
+static int buffered(BLOCKNUM block);
+static int ch_scanning(void);
+static void ch_dontneed(POSITION pos, POSITION len);
+
+#if USE_MMAP
+/*
+ * Release the currently mapped window, if any.
+ */
+static void ch_unmap(void)
+{
+	if (thisfile->mapaddr != NULL)
+		munmap((void *) thisfile->mapaddr, thisfile->maplen);
+	thisfile->mapaddr = NULL;
+	thisfile->maplen = 0;
+}
+
+/*
+ * Map the window which contains a specified position.
+ * If the mapping fails, stop using mmap for this file.
+ */
+static int ch_mapwin(POSITION pos)
+{
+	POSITION mpos = pos - (pos % MAPWIN_SIZE);
+	size_t mlen = MAPWIN_SIZE;
+	POSITION oldpos = thisfile->mappos;
+	size_t oldlen = thisfile->maplen;
+	void *addr;
+
+	ch_unmap();
+	if (oldlen > 0 && ch_scanning())
+		/*
+		 * A scan has moved past the old window:
+		 * we don't expect to need it again soon.
+		 */
+		ch_dontneed(oldpos, (POSITION) oldlen);
+	if (mpos + (POSITION) mlen > thisfile->mapsize)
+		mlen = (size_t) (thisfile->mapsize - mpos);
+	addr = mmap(NULL, mlen, PROT_READ, MAP_SHARED, ch_file, (off_t) mpos);
+	if (addr == MAP_FAILED)
+	{
+		ch_flags &= ~CH_MAPPED;
+		return (1);
+	}
+	thisfile->mapaddr = (unsigned char *) addr;
+	thisfile->mappos = mpos;
+	thisfile->maplen = mlen;
+	return (0);
+}
+
+/*
+ * Decide whether to read the current file via mmap.
+ * Only regular files are mapped; pipes, /proc files and
+ * the help file use the buffer pool.
+ */
+static void ch_mapinit(void)
+{
+	struct stat st;
+
+	ch_unmap();
+	ch_flags &= ~CH_MAPPED;
+	map_faulted = FALSE;
+	if (!(ch_flags & CH_CANSEEK) || (ch_flags & (CH_HELPFILE|CH_NODATA|CH_COLD)))
+		return;
+	if (ch_fsize == NULL_POSITION || ch_fsize <= 0)
+		return;
+	if (fstat(ch_file, &st) < 0 || !S_ISREG(st.st_mode))
+		return;
+	thisfile->mapsize = ch_fsize;
+	ch_flags |= CH_MAPPED;
+}
+#endif
+
+/*
+ * Called from the SIGBUS handler.
+ * Reading a mapped file that has been truncated causes SIGBUS.
+ * Only the current file is ever mapped (ch_close unmaps a file),
+ * so if it has a mapping, the fault came from it.
+ * Just note that the mapping must not be used again; the handler
+ * then abandons the command which was reading it, and ch_get
+ * drops the mapping and reads the file into buffers, so it is
+ * seen as it is now.
+ * Return FALSE if the fault did not come from our mapping.
+ */
+public int ch_mapfault(void)
+{
+#if USE_MMAP
+	if (thisfile == NULL || thisfile->mapaddr == NULL || map_faulted)
+		return (FALSE);
+	map_faulted = TRUE;
+	return (TRUE);
+#else
+	return (FALSE);
+#endif
+}
+
+/*
+ * Is the current file being scanned sequentially over a long distance?
+ */
+static int ch_scanning(void)
+{
+	return ((POSITION) thisfile->seqcount * ch_blksize >= SCAN_SIZE);
+}
+
+/*
+ * Tell the system that we no longer need part of the file.
+ */
+static void ch_dontneed(POSITION pos, POSITION len)
+{
+#if USE_FADVISE && defined(POSIX_FADV_DONTNEED)
+	if (len > 0)
+		(void) posix_fadvise(ch_file, (off_t) pos, (off_t) len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+/*
+ * Decide whether to read the current file in cold mode.
+ * A file of at least --cold-read megabytes is read without mmap
+ * and without readahead by the system, and each part of it is
+ * dropped from the system cache as soon as it has been read into
+ * our buffers, so viewing a huge file doesn't push the data
+ * of other programs out of the cache.
+ */
+static void ch_coldinit(void)
+{
+#if USE_FADVISE && defined(POSIX_FADV_DONTNEED) && defined(POSIX_FADV_RANDOM)
+	int wascold = (ch_flags & CH_COLD);
+
+	ch_flags &= ~CH_COLD;
+	if (cold_read >= 0 && (ch_flags & CH_CANSEEK) && 
+	    !(ch_flags & (CH_HELPFILE|CH_NODATA)) &&
+	    ch_fsize != NULL_POSITION && ch_fsize >= (POSITION) cold_read * 1024 * 1024)
+		ch_flags |= CH_COLD;
+	if (ch_flags & CH_COLD)
+		(void) posix_fadvise(ch_file, 0, 0, POSIX_FADV_RANDOM);
+	else if (wascold)
+		(void) posix_fadvise(ch_file, 0, 0, POSIX_FADV_NORMAL);
+#endif
+}
+
+/*
+ * Drop data which has just been read in cold mode from the system cache.
+ */
+static void ch_colddrop(POSITION pos, POSITION len)
+{
+	POSITION start = pos;
+	POSITION end = pos + len;
+
+	if (len <= 0)
+		return;
+	if (thisfile->seqdir < 0)
+		end += COLD_DROP_SIZE;
+	else
+		start -= COLD_DROP_SIZE;
+	if (start < 0)
+		start = 0;
+	ch_dontneed(start, end - start);
+}
+
+#if USE_FADVISE
+/*
+ * Ask the system to start reading the part of the file 
+ * which a sequential scan in direction dir will need next.
+ * A new request is made only when the read pointer gets 
+ * within half of READAHEAD_SIZE of the end of the previous one.
+ */
+static void ch_readahead(int dir)
+{
+	POSITION pos = ch_block * ch_blksize;
+	POSITION start;
+	POSITION end;
+	POSITION len;
+
+	if (dir > 0)
+	{
+		if (thisfile->rapos != NULL_POSITION && thisfile->rapos - pos > READAHEAD_SIZE / 2)
+			return;
+		start = pos;
+		if (thisfile->rapos != NULL_POSITION && thisfile->rapos > start)
+			start = thisfile->rapos;
+		end = pos + READAHEAD_SIZE;
+		len = ch_length();
+		if (len != NULL_POSITION && end > len)
+			end = len;
+		thisfile->rapos = end;
+	} else
+	{
+		if (thisfile->rapos != NULL_POSITION && pos - thisfile->rapos > READAHEAD_SIZE / 2)
+			return;
+		end = pos + ch_blksize;
+		if (thisfile->rapos != NULL_POSITION && thisfile->rapos < end)
+			end = thisfile->rapos;
+		start = pos - READAHEAD_SIZE;
+		if (start < 0)
+			start = 0;
+		thisfile->rapos = start;
+	}
+	if (start < end)
+		(void) posix_fadvise(ch_file, (off_t) start, (off_t) (end - start), POSIX_FADV_WILLNEED);
+}
+#endif
+
+/*
+ * Called when the read pointer moves into the adjacent block
+ * in direction dir (1 = forward, -1 = backward).
+ * Keep track of sequential access, and read ahead of it.
+ */
+static void ch_seqaccess(int dir)
+{
+	if (!(ch_flags & CH_CANSEEK) || (ch_flags & CH_HELPFILE))
+		return;
+	if (thisfile->seqdir == dir && ch_block == thisfile->seqblock + dir)
+		thisfile->seqcount++;
+	else
+	{
+		thisfile->seqdir = dir;
+		thisfile->seqcount = 1;
+		thisfile->rapos = NULL_POSITION;
+	}
+	thisfile->seqblock = ch_block;
+#if USE_FADVISE
+	if (thisfile->seqcount >= SEQ_MIN_BLOCKS && !(ch_flags & CH_COLD))
+		ch_readahead(dir);
+#endif
+}
+
+/*
+ * With --spool, all data read from a non-seekable file is also 
+ * written to a spool file, so that blocks can be discarded from the
+ * buffer pool and read back from the spool file when needed again.
+ * The spool file is unlinked as soon as it is created.
+ */
+static void ch_spoolinit(void)
+{
+#if HAVE_MKSTEMP
+	char *dir;
+	char *name;
+	int len;
+	int fd;
+
+	if (!use_spool || secure || 
+	    (ch_flags & (CH_CANSEEK|CH_HELPFILE|CH_NODATA)) || ch_fpos != 0)
+		return;
+	dir = lgetenv("LESSSPOOLDIR");
+	if (isnullenv(dir))
+		dir = lgetenv("TMPDIR");
+	if (isnullenv(dir))
+		dir = "/tmp";
+	len = (int) strlen(dir) + 16;
+	name = (char *) ecalloc(len, sizeof(char));
+	SNPRINTF1(name, len, "%s/lessXXXXXX", dir);
+	fd = mkstemp(name);
+	if (fd >= 0)
+		unlink(name);
+	free(name);
+	if (fd < 0)
+	{
+		error("Cannot create spool file", NULL_PARG);
+		return;
+	}
+	thisfile->spoolfd = fd;
+#endif
+}
+
+/*
+ * Are we spooling the data being read from the current file?
+ * If a write to the spool file failed, spoolpos stops 
+ * following ch_fpos, and we stop spooling.
+ */
+static int ch_spooling(void)
+{
+	return (thisfile->spoolfd >= 0 && thisfile->spoolpos == ch_fpos);
+}
+
+/*
+ * Append data just read from the file to the spool file.
+ */
+static void ch_spool(unsigned char *p, int n)
+{
+	if (lseek(thisfile->spoolfd, (off_t)thisfile->spoolpos, SEEK_SET) == BAD_LSEEK ||
+	    write(thisfile->spoolfd, (char *) p, n) != n)
+	{
+		error("Cannot write spool file", NULL_PARG);
+		return;
+	}
+	thisfile->spoolpos += n;
+}
+
+/*
+ * Can a block of the file be read back from the spool file?
+ */
+static int spooled(BLOCKNUM block)
+{
+	return (block * ch_blksize < thisfile->spoolpos);
+}
+
+/*
+ * Read data into a buffer from the spool file.
+ * pos is the position of the end of the data already in the buffer.
+ */
+static int ch_unspool(struct buf *bp, POSITION pos)
+{
+	unsigned int len = ch_blksize - bp->datasize;
+	int n;
+
+	if ((POSITION) len > thisfile->spoolpos - pos)
+		len = (unsigned int) (thisfile->spoolpos - pos);
+	if (lseek(thisfile->spoolfd, (off_t)pos, SEEK_SET) == BAD_LSEEK)
+		return (-1);
+	n = read(thisfile->spoolfd, &bp->data[bp->datasize], len);
+	if (n > 0)
+		bp->datasize += n;
+	return (n);
+}
+
+/*
+ * Close the spool file, if any.
+ */
+static void ch_endspool(void)
+{
+	if (thisfile->spoolfd >= 0)
+		close(thisfile->spoolfd);
+	thisfile->spoolfd = -1;
+	thisfile->spoolpos = 0;
+}
+
+/*
+ * Return the max number of buffers for the current file,
+ * or -1 if there is no limit.
+ */
+static int ch_maxbufs(void)
+{
+	int bufk;
+	int n;
+
+	if (maxbufspace < 0)
+		return (-1);
+	bufk = ch_blksize / 1024;
+	n = maxbufspace / bufk + (maxbufspace % bufk != 0);
+	if (n < 1)
+		n = 1;
+	return (n);
+}
+
+/*
+ * Can a buffer of a file be discarded without losing data?
+ */
+static int reclaimable(struct filestate *fs, struct buf *bp)
+{
+	if (bp->block == -1 || (fs->flags & CH_CANSEEK))
+		return (TRUE);
+	/* A block of a pipe can be discarded if it is in the spool file. */
+	return (bp->block * fs->blksize + bp->datasize <= fs->spoolpos);
+}
+
+/*
+ * Free buffers belonging to files other than the current one,
+ * starting with the least recently used file,
+ * until a new buffer of the current file fits in --total-buffers.
+ * Return FALSE if it still doesn't fit.
+ */
+static int ch_reclaim(void)
+{
+	struct filestate *fs;
+	struct bufnode *bn;
+	struct bufnode *pbn;
+	struct buf *bp;
+	POSITION limit;
+
+	if (total_bufspace < 0)
+		return (TRUE);
+	limit = (POSITION) total_bufspace * 1024;
+	for (fs = fslist.fsprev;  fs != &fslist;  fs = fs->fsprev)
+	{
+		if (totbufbytes + ch_blksize <= limit)
+			break;
+		if (fs == thisfile)
+			continue;
+		for (bn = fs->buflist.prev;  bn != &fs->buflist;  bn = pbn)
+		{
+			if (totbufbytes + ch_blksize <= limit)
+				break;
+			pbn = bn->prev;
+			bp = bufnode_buf(bn);
+			if (!reclaimable(fs, bp))
+				continue;
+			BUF_RM(bn);
+			BUF_HASH_RM(bn);
+			free(bp);
+			fs->nbufs--;
+			totbufbytes -= fs->blksize;
+		}
+	}
+	return (totbufbytes + ch_blksize <= limit);
+}
+
+/*
+ * Take a buffer to hold a specified block, which is not yet buffered.
+ * Use the least recently used buffer, unless it has data in it
+ * and we are allowed to allocate a new one.
+ * The buffer is left at the tail of the buffer chain.
+ */
+static struct bufnode * ch_takebuf(BLOCKNUM block)
+{
+	struct buf *bp;
+	struct bufnode *bn;
+	int maxbufs;
+	int mustgrow;
+
+	if (ch_buftail == END_OF_CHAIN || 
+		bufnode_buf(ch_buftail)->block != -1)
+	{
+		/*
+		 * There is no empty buffer to use.
+		 * Allocate a new buffer if:
+		 * 1. We can't seek on this file, we're not spooling it,
+		 *    and -B is not in effect; or
+		 * 2. We haven't allocated the max buffers for this file yet,
+		 *    and there is room for it within --total-buffers.
+		 * In case 1, or if we have no buffer at all,
+		 * we allocate one even if it exceeds --total-buffers.
+		 */
+		mustgrow = (autobuf && !(ch_flags & CH_CANSEEK) && !ch_spooling()) ||
+			ch_buftail == END_OF_CHAIN;
+		maxbufs = ch_maxbufs();
+		if (mustgrow ||
+			((maxbufs < 0 || ch_nbufs < maxbufs) && ch_reclaim()))
+			if (ch_addbuf())
+				/*
+				 * Allocation failed: turn off autobuf.
+				 */
+				autobuf = OPT_OFF;
+	}
+	bn = ch_buftail;
+	bp = bufnode_buf(bn);
+	if (bp->block != -1 && (ch_flags & CH_CANSEEK) && ch_scanning())
+		ch_dontneed(bp->block * ch_blksize, (POSITION) bp->datasize);
+	BUF_HASH_RM(bn); /* Remove from old hash chain. */
+	bp->block = block;
+	bp->datasize = 0;
+	BUF_HASH_INS(bn, BUFHASH(block)); /* Insert into new hash chain. */
+	return (bn);
+}
+
+#if USE_READV
+/*
+ * Decide how many blocks to read with one system call.
+ * A miss on the block just after the last one read doubles the
+ * size of the read, so a long sequential scan soon reads large
+ * parts of the file at once; any other miss reads just one block.
+ * Each block read takes a buffer, so the reads are also limited 
+ * to half of the buffers allowed by -b.
+ */
+static int ch_nreadblks(void)
+{
+	int maxbufs;
+	int n;
+
+	if (ch_block == thisfile->lastread + 1)
+	{
+		n = thisfile->nreadblks * 2;
+		if (n > thisfile->maxreadblks)
+			n = thisfile->maxreadblks;
+	} else
+		n = 1;
+	maxbufs = ch_maxbufs();
+	if (maxbufs >= 0 && n > maxbufs / 2)
+		n = (maxbufs >= 2) ? maxbufs / 2 : 1;
+	thisfile->nreadblks = n;
+	return (n);
+}
+
+/*
+ * Read the current block into an empty buffer, 
+ * reading ahead into more buffers if the file is being scanned.
+ * Return the number of bytes read into bp, like iread.
+ */
+static int ch_readblocks(struct buf *bp)
+{
+	struct iovec iov[MAXREADBLKS];
+	struct buf *xbp[MAXREADBLKS];
+	struct bufnode *bn;
+	POSITION len;
+	BLOCKNUM block;
+	unsigned int size;
+	int nblks;
+	int i;
+	int n;
+
+	nblks = ch_nreadblks();
+	thisfile->lastread = ch_block;
+	if (nblks <= 1)
+		return (iread(ch_file, bp->data, ch_blksize));
+
+	/*
+	 * Move the buffer to the head of the chain,
+	 * so it won't be taken to hold one of the following blocks.
+	 */
+	bn = &bp->node;
+	BUF_RM(bn);
+	BUF_INS_HEAD(bn);
+	iov[0].iov_base = (void *) bp->data;
+	iov[0].iov_len = ch_blksize;
+	len = ch_length();
+	for (i = 1;  i < nblks;  i++)
+	{
+		block = ch_block + i;
+		if (len != NULL_POSITION && block * ch_blksize >= len)
+			break;
+		if (buffered(block))
+			break;
+		bn = ch_takebuf(block);
+		BUF_RM(bn);
+		BUF_INS_HEAD(bn);
+		xbp[i] = bufnode_buf(bn);
+		iov[i].iov_base = (void *) xbp[i]->data;
+		iov[i].iov_len = ch_blksize;
+	}
+	nblks = i;
+	n = ireadv(ch_file, iov, nblks);
+
+	/*
+	 * Distribute the data among the buffers.
+	 * The caller accounts for the data in the first buffer;
+	 * any buffer which got no data is made free again.
+	 */
+	for (i = 1;  i < nblks;  i++)
+	{
+		size = 0;
+		if (n > (int) (i * ch_blksize))
+		{
+			size = n - (i * ch_blksize);
+			if (size > ch_blksize)
+				size = ch_blksize;
+		}
+		if (size == 0)
+		{
+			bn = &xbp[i]->node;
+			xbp[i]->block = -1;
+			BUF_RM(bn);
+			BUF_INS_TAIL(bn);
+			continue;
+		}
+		xbp[i]->datasize = size;
+		ch_fpos += size;
+		thisfile->lastread = ch_block + i;
+	}
+	if (n > (int) ch_blksize)
+		n = ch_blksize;
+	return (n);
+}
+#endif
+
+/*
+ * Wait for more data to be added to the file.
+ * A regular file is watched, so we can wait until it changes
+ * rather than checking it again and again.
+ */
+static void ch_wait(int read_again)
+{
+	char *filename;
 
+	if (!read_again && (ch_flags & CH_CANSEEK) && !(ch_flags & CH_HELPFILE))
+	{
+		filename = get_altfilename(curr_ifile);
+		if (filename == NULL)
+			filename = get_filename(curr_ifile);
+		if (follow_watch(filename, follow_mode == FOLLOW_NAME))
+		{
+			follow_wait(FOLLOW_WAIT_MS);
+			return;
+		}
+	}
+	sleep_ms(50); /* Reduce system load */
+}
+
+/*
+ * Find the buffer holding a specified block.
+ * Return NULL if the block is not buffered.
+ */
+static struct bufnode * ch_findbuf(BLOCKNUM block)
+{
+	struct bufnode *bn;
+	int h;
+
+	h = BUFHASH(block);
+	FOR_BUFS_IN_CHAIN(h, bn)
+	{
+		if (bufnode_buf(bn)->block == block)
+			break;
+	}
+	if (bn == END_OF_HCHAIN(h))
+		return (NULL);
+	return (bn);
+}
 
 /*
  * Get the character pointed to by the read pointer.
@@ -151,13 +906,42 @@ static int ch_get(void)
 	struct bufnode *bn;
 	int n;
 	int read_again;
-	int h;
 	POSITION pos;
 	POSITION len;
 
 	if (thisfile == NULL)
 		return (EOI);
 
+#if USE_MMAP
+	if (ch_flags & CH_MAPPED)
+	{
+		if (map_faulted)
+		{
+			/*
+			 * The file shrank while it was mapped.
+			 * Go back to reading it into buffers.
+			 */
+			ch_unmap();
+			ch_flags &= ~CH_MAPPED;
+			map_faulted = FALSE;
+			ch_fsize = filesize(ch_file);
+		} else
+		{
+			pos = (ch_block * ch_blksize) + ch_offset;
+			if (pos < thisfile->mapsize)
+			{
+				if ((len = ch_length()) != NULL_POSITION && pos >= len)
+					return (EOI);
+				if ((thisfile->mapaddr != NULL &&
+				     pos >= thisfile->mappos &&
+				     pos < thisfile->mappos + (POSITION) thisfile->maplen) ||
+				    ch_mapwin(pos) == 0)
+					return (thisfile->mapaddr[pos - thisfile->mappos]);
+			}
+		}
+	}
+#endif
+
 	/*
 	 * Quick check for the common case where 
 	 * the desired char is in the head buffer.
@@ -173,57 +957,29 @@ static int ch_get(void)
 	 * Look for a buffer holding the desired block.
 	 */
 	waiting_for_data = FALSE;
-	h = BUFHASH(ch_block);
-	FOR_BUFS_IN_CHAIN(h, bn)
+	bn = ch_findbuf(ch_block);
+	if (bn != NULL)
 	{
 		bp = bufnode_buf(bn);
-		if (bp->block == ch_block)
-		{
-			if (ch_offset >= bp->datasize)
-				/*
-				 * Need more data in this buffer.
-				 */
-				break;
+		if (ch_offset < bp->datasize)
 			goto found;
-		}
-	}
-	if (bn == END_OF_HCHAIN(h))
+		/*
+		 * Need more data in this buffer.
+		 */
+	} else
 	{
 		/*
 		 * Block is not in a buffer.  
 		 * Take the least recently used buffer 
 		 * and read the desired block into it.
-		 * If the LRU buffer has data in it, 
-		 * then maybe allocate a new buffer.
 		 */
-		if (ch_buftail == END_OF_CHAIN || 
-			bufnode_buf(ch_buftail)->block != -1)
-		{
-			/*
-			 * There is no empty buffer to use.
-			 * Allocate a new buffer if:
-			 * 1. We can't seek on this file and -b is not in effect; or
-			 * 2. We haven't allocated the max buffers for this file yet.
-			 */
-			if ((autobuf && !(ch_flags & CH_CANSEEK)) ||
-				(maxbufs < 0 || ch_nbufs < maxbufs))
-				if (ch_addbuf())
-					/*
-					 * Allocation failed: turn off autobuf.
-					 */
-					autobuf = OPT_OFF;
-		}
-		bn = ch_buftail;
+		bn = ch_takebuf(ch_block);
 		bp = bufnode_buf(bn);
-		BUF_HASH_RM(bn); /* Remove from old hash chain. */
-		bp->block = ch_block;
-		bp->datasize = 0;
-		BUF_HASH_INS(bn, h); /* Insert into new hash chain. */
 	}
 
 	for (;;)
 	{
-		pos = (ch_block * LBUFSIZE) + bp->datasize;
+		pos = (ch_block * ch_blksize) + bp->datasize;
 		if ((len = ch_length()) != NULL_POSITION && pos >= len)
 			/*
 			 * At end of file.
@@ -234,11 +990,16 @@ static int ch_get(void)
 		{
 			/*
 			 * Not at the correct position: must seek.
-			 * If input is a pipe, we're in trouble (can't seek on a pipe).
-			 * Some data has been lost: just return "?".
+			 * If input is a pipe, we can't seek on it,
+			 * but the data may be in the spool file.
+			 * Otherwise some data has been lost: just return "?".
 			 */
 			if (!(ch_flags & CH_CANSEEK))
+			{
+				if (pos < thisfile->spoolpos && ch_unspool(bp, pos) > 0)
+					goto found;
 				return ('?');
+			}
 			if (lseek(ch_file, (off_t)pos, SEEK_SET) == BAD_LSEEK)
 			{
 				error("seek error", NULL_PARG);
@@ -263,9 +1024,16 @@ static int ch_get(void)
 			bp->data[bp->datasize] = helpdata[ch_fpos];
 			n = 1;
 		} else
+#if USE_READV
+		if (bp->datasize == 0 && thisfile->maxreadblks > 1 &&
+			(ch_flags & CH_CANSEEK))
+		{
+			n = ch_readblocks(bp);
+		} else
+#endif
 		{
 			n = iread(ch_file, &bp->data[bp->datasize], 
-				(unsigned int)(LBUFSIZE - bp->datasize));
+				(unsigned int)(ch_blksize - bp->datasize));
 		}
 
 		read_again = FALSE;
@@ -298,9 +1066,13 @@ static int ch_get(void)
 		if (!secure && logfile >= 0 && n > 0)
 			write(logfile, (char *) &bp->data[bp->datasize], n);
 #endif
+		if (n > 0 && ch_spooling())
+			ch_spool(&bp->data[bp->datasize], n);
 
 		ch_fpos += n;
 		bp->datasize += n;
+		if (ch_flags & CH_COLD)
+			ch_colddrop(pos, ch_fpos - pos);
 
 		if (n == 0)
 		{
@@ -318,7 +1090,7 @@ static int ch_get(void)
 					ixerror("%s", &parg);
 					waiting_for_data = TRUE;
 				}
-				sleep_ms(50); /* Reduce system load */
+				ch_wait(read_again);
 			}
 			if (ignore_eoi && follow_mode == FOLLOW_NAME && curr_ifile_changed())
 			{
@@ -344,7 +1116,7 @@ static int ch_get(void)
 			 * Move to head of hash chain too.
 			 */
 			BUF_HASH_RM(bn);
-			BUF_HASH_INS(bn, h);
+			BUF_HASH_INS(bn, BUFHASH(ch_block));
 		}
 
 		if (ch_offset < bp->datasize)
@@ -406,7 +1178,7 @@ public void sync_logfile(void)
 	BLOCKNUM block;
 	BLOCKNUM nblocks;
 
-	nblocks = (ch_fpos + LBUFSIZE - 1) / LBUFSIZE;
+	nblocks = (ch_fpos + ch_blksize - 1) / ch_blksize;
 	for (block = 0;  block < nblocks;  block++)
 	{
 		int wrote = FALSE;
@@ -436,18 +1208,7 @@ public void sync_logfile(void)
  */
 static int buffered(BLOCKNUM block)
 {
-	struct buf *bp;
-	struct bufnode *bn;
-	int h;
-
-	h = BUFHASH(block);
-	FOR_BUFS_IN_CHAIN(h, bn)
-	{
-		bp = bufnode_buf(bn);
-		if (bp->block == block)
-			return (TRUE);
-	}
-	return (FALSE);
+	return (ch_findbuf(block) != NULL);
 }
 
 /*
@@ -466,8 +1227,9 @@ public int ch_seek(POSITION pos)
 	if (pos < ch_zero() || (len != NULL_POSITION && pos > len))
 		return (1);
 
-	new_block = pos / LBUFSIZE;
-	if (!(ch_flags & CH_CANSEEK) && pos != ch_fpos && !buffered(new_block))
+	new_block = pos / ch_blksize;
+	if (!(ch_flags & CH_CANSEEK) && pos != ch_fpos && !buffered(new_block) &&
+	    pos >= thisfile->spoolpos)
 	{
 		if (ch_fpos > pos)
 			return (1);
@@ -482,9 +1244,20 @@ public int ch_seek(POSITION pos)
 	}
 	/*
 	 * Set read pointer.
+	 * Moving to an adjacent block may be part of a sequential scan;
+	 * moving any farther ends it.
 	 */
-	ch_block = new_block;
-	ch_offset = pos % LBUFSIZE;
+	if (new_block == ch_block + 1 || new_block == ch_block - 1)
+	{
+		BLOCKNUM old_block = ch_block;
+		ch_block = new_block;
+		ch_seqaccess((int) (new_block - old_block));
+	} else if (new_block != ch_block)
+	{
+		thisfile->seqcount = 0;
+		ch_block = new_block;
+	}
+	ch_offset = (unsigned int) (pos % ch_blksize);
 	return (0);
 }
 
@@ -531,7 +1304,7 @@ public int ch_end_buffer_seek(void)
 	FOR_BUFS(bn)
 	{
 		bp = bufnode_buf(bn);
-		buf_pos = (bp->block * LBUFSIZE) + bp->datasize;
+		buf_pos = (bp->block * ch_blksize) + bp->datasize;
 		if (buf_pos > end_pos)
 			end_pos = buf_pos;
 	}
@@ -595,7 +1368,7 @@ public POSITION ch_tell(void)
 {
 	if (thisfile == NULL)
 		return (NULL_POSITION);
-	return (ch_block * LBUFSIZE) + ch_offset;
+	return (ch_block * ch_blksize) + ch_offset;
 }
 
 /*
@@ -610,12 +1383,13 @@ public int ch_forw_get(void)
 	c = ch_get();
 	if (c == EOI)
 		return (EOI);
-	if (ch_offset < LBUFSIZE-1)
+	if (ch_offset < ch_blksize-1)
 		ch_offset++;
 	else
 	{
 		ch_block ++;
 		ch_offset = 0;
+		ch_seqaccess(1);
 	}
 	return (c);
 }
@@ -633,35 +1407,311 @@ public int ch_back_get(void)
 	{
 		if (ch_block <= 0)
 			return (EOI);
-		if (!(ch_flags & CH_CANSEEK) && !buffered(ch_block-1))
+		if (!(ch_flags & CH_CANSEEK) && !buffered(ch_block-1) &&
+		    !spooled(ch_block-1))
 			return (EOI);
 		ch_block--;
-		ch_offset = LBUFSIZE-1;
+		ch_offset = ch_blksize-1;
+		ch_seqaccess(-1);
 	}
 	return (ch_get());
 }
 
+/*
+ * What a span of data which has been lost from a pipe contains.
+ */
+static unsigned char lost_data[1] = { '?' };
+
+/*
+ * Return the address in memory of the data at the read pointer,
+ * which must already have been read by ch_get.
+ * Also return the number of bytes of the current block which are
+ * in memory before (*beforep) and after (*afterp) that address.
+ * Return NULL if the data is not in memory (ch_get returned "?"
+ * because the data of a pipe has been lost).
+ */
+static unsigned char * ch_addr(unsigned int *beforep, unsigned int *afterp)
+{
+	struct buf *bp;
+#if USE_MMAP
+	POSITION pos;
+	POSITION end;
+
+	pos = (ch_block * ch_blksize) + ch_offset;
+	if ((ch_flags & CH_MAPPED) && !map_faulted && thisfile->mapaddr != NULL &&
+	    pos < thisfile->mapsize && pos >= thisfile->mappos &&
+	    pos < thisfile->mappos + (POSITION) thisfile->maplen)
+	{
+		end = thisfile->mappos + (POSITION) thisfile->maplen;
+		if (end > thisfile->mapsize)
+			end = thisfile->mapsize;
+		if (end > pos + (ch_blksize - ch_offset))
+			end = pos + (ch_blksize - ch_offset);
+		*afterp = (unsigned int) (end - pos);
+		*beforep = ch_offset;
+		if ((POSITION) *beforep > pos - thisfile->mappos)
+			*beforep = (unsigned int) (pos - thisfile->mappos);
+		return (&thisfile->mapaddr[pos - thisfile->mappos]);
+	}
+#endif
+	/*
+	 * ch_get leaves the buffer holding the current block at the head,
+	 * unless it couldn't read the block.
+	 */
+	if (ch_bufhead == END_OF_CHAIN)
+		return (NULL);
+	bp = bufnode_buf(ch_bufhead);
+	if (bp->block != ch_block || ch_offset >= bp->datasize)
+		return (NULL);
+	*afterp = bp->datasize - ch_offset;
+	*beforep = ch_offset;
+	return (&bp->data[ch_offset]);
+}
+
+/*
+ * Get a span of contiguous data starting at the read pointer,
+ * without moving the read pointer.
+ * Set *pp to point to the data and return its length, 
+ * or return 0 at end of file.
+ * The span never extends past the end of the current block,
+ * and is valid only until the next call to a ch_ function.
+ */
+public int ch_forw_span(unsigned char **pp)
+{
+	unsigned int before;
+	unsigned int after;
+
+	if (thisfile == NULL || ch_get() == EOI)
+		return (0);
+	*pp = ch_addr(&before, &after);
+	if (*pp == NULL)
+	{
+		/* Lost data reads as a single "?". */
+		*pp = lost_data;
+		return (1);
+	}
+	return ((int) after);
+}
+
+/*
+ * Get a span of contiguous data ending just before the read pointer,
+ * without moving the read pointer.
+ * Set *pp to point to the start of the data and return its length,
+ * or return 0 at the beginning of the file.
+ * The span never extends past the beginning of the current block,
+ * and is valid only until the next call to a ch_ function.
+ */
+public int ch_back_span(unsigned char **pp)
+{
+	unsigned char *p;
+	unsigned int before;
+	unsigned int after;
+	BLOCKNUM block;
+	unsigned int offset;
+
+	if (thisfile == NULL)
+		return (0);
+	block = ch_block;
+	offset = ch_offset;
+	if (ch_back_get() == EOI)
+	{
+		/*
+		 * ch_back_get may have moved back into a block
+		 * it couldn't read; leave the read pointer where it was.
+		 */
+		ch_block = block;
+		ch_offset = offset;
+		return (0);
+	}
+	p = ch_addr(&before, &after);
+	if (p == NULL)
+	{
+		/* Lost data reads as a single "?". */
+		*pp = lost_data;
+		before = 0;
+	} else
+		*pp = p - before;
+	/*
+	 * Undo the ch_back_get.
+	 */
+	ch_block = block;
+	ch_offset = offset;
+	return ((int) before + 1);
+}
+
+/*
+ * Move the read pointer forward (n > 0) or backward (n < 0) 
+ * over data obtained from ch_forw_span or ch_back_span.
+ */
+public void ch_skip(POSITION n)
+{
+	BLOCKNUM old_block;
+	POSITION pos;
+
+	if (thisfile == NULL)
+		return;
+	old_block = ch_block;
+	pos = (ch_block * ch_blksize) + ch_offset + n;
+	ch_block = pos / ch_blksize;
+	ch_offset = (unsigned int) (pos % ch_blksize);
+	if (ch_block == old_block + 1)
+		ch_seqaccess(1);
+	else if (ch_block == old_block - 1)
+		ch_seqaccess(-1);
+	else if (ch_block != old_block)
+		thisfile->seqcount = 0;
+}
+
 /*
  * Set max amount of buffer space.
  * bufspace is in units of 1024 bytes.  -1 mean no limit.
+ * The number of buffers this allows depends on the block size
+ * of each file; see ch_maxbufs.
  */
 public void ch_setbufspace(int bufspace)
 {
-	if (bufspace < 0)
-		maxbufs = -1;
-	else
+	maxbufspace = (bufspace < 0) ? -1 : bufspace;
+}
+
+/*
+ * Return the smallest --total-buffers value (K) 
+ * which leaves room for one buffer of the current file.
+ */
+public int ch_minbufspace(void)
+{
+	if (thisfile != NULL)
+		return (ch_blksize / 1024);
+	return ((block_size > 0) ? block_size : LBUFSIZE / 1024);
+}
+
+/*
+ * --total-buffers has changed.
+ * Free buffers of other files until the new limit is met.
+ */
+public void ch_trimbufspace(void)
+{
+	if (thisfile != NULL)
+		(void) ch_reclaim();
+}
+
+/*
+ * Set the block size of the current file from the --block-size option.
+ * This can only be done while the file has no buffers.
+ */
+static void ch_setblksize(void)
+{
+	if (block_size > 0)
+	{
+		ch_blksize = block_size * 1024;
+		thisfile->maxreadblks = 1;
+	} else
+	{
+		ch_blksize = LBUFSIZE;
+#if USE_READV
+		thisfile->maxreadblks = MAXREADBLKS;
+#else
+		thisfile->maxreadblks = 1;
+#endif
+	}
+	thisfile->nreadblks = 1;
+	thisfile->lastread = -1;
+}
+
+#if HAVE_STAT_INO
+/*
+ * Return a checksum of the CH_SUM_LEN bytes of the open file
+ * before position pos (or as many as there are),
+ * or 0 if they can't be read.
+ * This moves the file pointer, so the caller must seek afterwards.
+ */
+static unsigned long ch_sum(POSITION pos)
+{
+	unsigned char buf[CH_SUM_LEN];
+	unsigned long sum = 2166136261UL;
+	size_t len;
+	size_t i;
+
+	len = (pos < CH_SUM_LEN) ? (size_t) pos : CH_SUM_LEN;
+	if (lseek(ch_file, (off_t) (pos - len), SEEK_SET) == BAD_LSEEK ||
+	    read(ch_file, buf, len) != (ssize_t) len)
+		return (0);
+	for (i = 0;  i < len;  i++)
+		sum = (sum ^ buf[i]) * 16777619UL;
+	return (sum);
+}
+#endif
+
+/*
+ * Is the open file the same one whose data is in the buffers,
+ * with at most some data appended to it since it was closed?
+ * That is, it has the same device and i-number, 
+ * either its size and modification time are unchanged or it has grown,
+ * the data before its old end is unchanged (as far as a checksum 
+ * of the last CH_SUM_LEN bytes can tell),
+ * and it is not shorter than the data in any buffer.
+ * Also remember the identity of the file for next time.
+ */
+static int ch_appended(void)
+{
+#if HAVE_STAT_INO
+	struct stat st;
+	struct bufnode *bn;
+	struct buf *bp;
+	POSITION closesize;
+	int same;
+
+	closesize = thisfile->closesize;
+	thisfile->closesize = NULL_POSITION;
+	if (fstat(ch_file, &st) < 0)
+	{
+		thisfile->haveid = FALSE;
+		return (FALSE);
+	}
+	same = thisfile->haveid && 
+		st.st_dev == thisfile->dev && st.st_ino == thisfile->ino;
+	thisfile->haveid = TRUE;
+	thisfile->dev = st.st_dev;
+	thisfile->ino = st.st_ino;
+	if (!same || closesize == NULL_POSITION)
+		return (FALSE);
+	/*
+	 * If the file has been written since it was closed,
+	 * the buffers are still good only if it has grown.
+	 * The modification time may not change if it is rewritten
+	 * quickly, so check the end of the old data anyway.
+	 */
+	if ((POSITION) st.st_size < closesize ||
+	    ((POSITION) st.st_size == closesize && st.st_mtime != thisfile->closemtime) ||
+	    ch_sum(closesize) != thisfile->closesum)
+		return (FALSE);
+	FOR_BUFS(bn)
 	{
-		int lbufk = LBUFSIZE / 1024;
-		maxbufs = bufspace / lbufk + (bufspace % lbufk != 0);
-		if (maxbufs < 1)
-			maxbufs = 1;
+		bp = bufnode_buf(bn);
+		if (bp->block != -1 && 
+		    bp->block * ch_blksize + bp->datasize > (POSITION) st.st_size)
+			return (FALSE);
 	}
+	return (TRUE);
+#else
+	return (FALSE);
+#endif
 }
 
 /*
  * Flush (discard) any saved file state, including buffer contents.
  */
 public void ch_flush(void)
+{
+	ch_reset(FALSE);
+}
+
+/*
+ * Reset the file state to read from the beginning of the file.
+ * If keep is set, and the file has only had data appended to it
+ * since the buffers were filled, keep the buffer contents;
+ * otherwise discard them.
+ */
+static void ch_reset(int keep)
 {
 	struct bufnode *bn;
 
@@ -681,9 +1731,12 @@ public void ch_flush(void)
 	/*
 	 * Initialize all the buffers.
 	 */
-	FOR_BUFS(bn)
+	if (!ch_appended() || !keep)
 	{
-		bufnode_buf(bn)->block = -1;
+		FOR_BUFS(bn)
+		{
+			bufnode_buf(bn)->block = -1;
+		}
 	}
 
 	/*
@@ -695,8 +1748,12 @@ public void ch_flush(void)
 	 * Seek to a known position: the beginning of the file.
 	 */
 	ch_fpos = 0;
-	ch_block = 0; /* ch_fpos / LBUFSIZE; */
-	ch_offset = 0; /* ch_fpos % LBUFSIZE; */
+	ch_block = 0; /* ch_fpos / ch_blksize; */
+	ch_offset = 0; /* ch_fpos % ch_blksize; */
+	thisfile->lastread = -1;
+	thisfile->seqdir = 0;
+	thisfile->seqcount = 0;
+	thisfile->rapos = NULL_POSITION;
 
 #if HAVE_PROCFS
 	/*
@@ -719,6 +1776,7 @@ public void ch_flush(void)
 	}
 #endif
 
+	ch_coldinit();
 	if (lseek(ch_file, (off_t)0, SEEK_SET) == BAD_LSEEK)
 	{
 		/*
@@ -728,6 +1786,9 @@ public void ch_flush(void)
 		 */
 		error("seek error to 0", NULL_PARG);
 	}
+#if USE_MMAP
+	ch_mapinit();
+#endif
 }
 
 /*
@@ -743,32 +1804,71 @@ static int ch_addbuf(void)
 	 * Allocate and initialize a new buffer and link it 
 	 * onto the tail of the buffer list.
 	 */
-	bp = (struct buf *) calloc(1, sizeof(struct buf));
+	bp = (struct buf *) calloc(1, sizeof(struct buf) + ch_blksize);
 	if (bp == NULL)
 		return (1);
+	bp->data = (unsigned char *) (bp + 1);
 	ch_nbufs++;
+	totbufbytes += ch_blksize;
 	bp->block = -1;
 	bn = &bp->node;
 
 	BUF_INS_TAIL(bn);
 	BUF_HASH_INS(bn, 0);
+	if (ch_nbufs > thisfile->hashsize)
+		ch_growhash();
 	return (0);
 }
 
 /*
- *
+ * Initialize the hash table to hashsize empty chains.
  */
 static void init_hashtbl(void)
 {
 	int h;
 
-	for (h = 0;  h < BUFHASH_SIZE;  h++)
+	for (h = 0;  h < thisfile->hashsize;  h++)
 	{
 		thisfile->hashtbl[h].hnext = END_OF_HCHAIN(h);
 		thisfile->hashtbl[h].hprev = END_OF_HCHAIN(h);
 	}
 }
 
+/*
+ * Allocate a hash table with BUFHASH_SIZE chains.
+ */
+static void new_hashtbl(void)
+{
+	thisfile->hashsize = BUFHASH_SIZE;
+	thisfile->hashtbl = (struct bufnode *) 
+		ecalloc(thisfile->hashsize, sizeof(struct bufnode));
+	init_hashtbl();
+}
+
+/*
+ * Double the size of the hash table and rehash all the buffers.
+ * If there is no memory for a bigger table, keep the old one;
+ * lookups are slower but still work.
+ */
+static void ch_growhash(void)
+{
+	struct bufnode *tbl;
+	struct bufnode *bn;
+
+	tbl = (struct bufnode *) 
+		calloc(thisfile->hashsize * 2, sizeof(struct bufnode));
+	if (tbl == NULL)
+		return;
+	free(thisfile->hashtbl);
+	thisfile->hashtbl = tbl;
+	thisfile->hashsize *= 2;
+	init_hashtbl();
+	FOR_BUFS(bn)
+	{
+		BUF_HASH_INS(bn, BUFHASH(bufnode_buf(bn)->block));
+	}
+}
+
 /*
  * Delete all buffers for this file.
  */
@@ -781,9 +1881,11 @@ static void ch_delbufs(void)
 		bn = ch_bufhead;
 		BUF_RM(bn);
 		free(bufnode_buf(bn));
+		totbufbytes -= ch_blksize;
 	}
 	ch_nbufs = 0;
-	init_hashtbl();
+	free(thisfile->hashtbl);
+	new_hashtbl();
 }
 
 /*
@@ -840,17 +1942,108 @@ public void ch_init(int f, int flags)
 		thisfile->offset = 0;
 		thisfile->file = -1;
 		thisfile->fsize = NULL_POSITION;
-		init_hashtbl();
+		thisfile->spoolfd = -1;
+		thisfile->spoolpos = 0;
+#if HAVE_STAT_INO
+		thisfile->closesize = NULL_POSITION;
+#endif
+		ch_setblksize();
+		new_hashtbl();
 		/*
 		 * Try to seek; set CH_CANSEEK if it works.
 		 */
 		if ((flags & CH_CANSEEK) && !seekable(f))
 			ch_flags &= ~CH_CANSEEK;
 		set_filestate(curr_ifile, (void *) thisfile);
+		ch_spoolinit();
+	} else
+	{
+		/*
+		 * Remove from the list of filestates;
+		 * it is put back at the head below.
+		 */
+		FS_RM(thisfile);
+		if (thisfile->file == -1 && (thisfile->flags & CH_CANSEEK))
+		{
+			/*
+			 * The buffers of a seekable file were kept
+			 * when it was closed (see ch_close).
+			 * If it can't be seeked now, they can't be used.
+			 */
+			thisfile->flags = flags;
+			if ((flags & CH_CANSEEK) && !seekable(f))
+				ch_flags &= ~CH_CANSEEK;
+			if (!(ch_flags & CH_CANSEEK))
+				ch_delbufs();
+		}
+		if (thisfile->nbufs == 0 && (thisfile->flags & CH_CANSEEK))
+		{
+			/*
+			 * The file has no buffers, and ch_flush will 
+			 * reset the read position, so the block size
+			 * can be changed if --block-size has changed.
+			 */
+			ch_setblksize();
+		}
 	}
+	FS_INS_HEAD(thisfile);
 	if (thisfile->file == -1)
 		thisfile->file = f;
-	ch_flush();
+	ch_reset(TRUE);
+}
+
+/*
+ * Decide whether to keep the buffers of the current file
+ * when it is closed.
+ * Unless --total-buffers bounds the memory used by the buffers
+ * of all files, the closed files keep only as much as -b allows 
+ * one file; the buffers of those closed longest ago are freed first.
+ */
+static int ch_keepbufs(void)
+{
+#if HAVE_STAT_INO
+	struct filestate *fs;
+	struct bufnode *bn;
+	struct stat st;
+	POSITION kept;
+
+	if ((ch_flags & (CH_POPENED|CH_HELPFILE)) || !thisfile->haveid || ch_nbufs == 0)
+		return (FALSE);
+	/*
+	 * Remember the state of the file, so ch_appended can tell
+	 * whether it has changed when it is opened again.
+	 */
+	if (fstat(ch_file, &st) < 0)
+		return (FALSE);
+	thisfile->closemtime = st.st_mtime;
+	thisfile->closesum = ch_sum((POSITION) st.st_size);
+	if (thisfile->closesum == 0)
+		return (FALSE);
+	thisfile->closesize = (POSITION) st.st_size;
+	if (total_bufspace >= 0 || maxbufspace < 0)
+		return (TRUE);
+	kept = 0;
+	for (fs = fslist.fsnext;  fs != &fslist;  fs = fs->fsnext)
+	{
+		if (!(fs->flags & CH_CANSEEK) || (fs != thisfile && fs->file != -1))
+			continue;
+		kept += (POSITION) fs->nbufs * fs->blksize;
+		if (fs == thisfile || kept <= (POSITION) maxbufspace * 1024)
+			continue;
+		while (fs->buflist.next != &fs->buflist)
+		{
+			bn = fs->buflist.next;
+			BUF_RM(bn);
+			BUF_HASH_RM(bn);
+			free(bufnode_buf(bn));
+			fs->nbufs--;
+			totbufbytes -= fs->blksize;
+		}
+	}
+	return (TRUE);
+#else
+	return (FALSE);
+#endif
 }
 
 /*
@@ -863,12 +2056,22 @@ public void ch_close(void)
 	if (thisfile == NULL)
 		return;
 
+	follow_unwatch();
 	if ((ch_flags & (CH_CANSEEK|CH_POPENED|CH_HELPFILE)) && !(ch_flags & CH_KEEPOPEN))
 	{
 		/*
 		 * We can seek or re-open, so we don't need to keep buffers.
+		 * But we keep those of a regular file, 
+		 * in case we come back to it before it changes.
 		 */
-		ch_delbufs();
+#if USE_MMAP
+		ch_unmap();
+		ch_flags &= ~CH_MAPPED;
+#endif
+		if (ch_keepbufs())
+			keepstate = TRUE;
+		else
+			ch_delbufs();
 	} else
 		keepstate = TRUE;
 	if (!(ch_flags & CH_KEEPOPEN))
@@ -889,6 +2092,9 @@ public void ch_close(void)
 		/*
 		 * We don't even need to keep the filestate structure.
 		 */
+		ch_endspool();
+		FS_RM(thisfile);
+		free(thisfile->hashtbl);
 		free(thisfile);
 		thisfile = NULL;
 		set_filestate(curr_ifile, (void *) NULL);
@@ -905,6 +2111,22 @@ public int ch_getflags(void)
 	return (ch_flags);
 }
 
+/*
+ * Return the file descriptor of the current file, if its data can be
+ * read directly at any position (that is, it is a seekable file of
+ * known size, not a pipe or the help file).  Otherwise return -1.
+ */
+public int ch_getfd(void)
+{
+	if (thisfile == NULL || ch_file < 0)
+		return (-1);
+	if (!(ch_flags & CH_CANSEEK) || (ch_flags & (CH_POPENED|CH_HELPFILE|CH_NODATA)))
+		return (-1);
+	if (thisfile->spoolfd >= 0 || ch_fsize == NULL_POSITION)
+		return (-1);
+	return (ch_file);
+}
+
 #if 0
 static void ch_dump(struct filestate *fs)
 {
@@ -920,8 +2142,8 @@ static void ch_dump(struct filestate *fs)
 	printf(" file %d, flags %x, fpos %x, fsize %x, blk/off %x/%x\n",
 		fs->file, fs->flags, fs->fpos, 
 		fs->fsize, fs->block, fs->offset);
-	printf(" %d bufs:\n", fs->nbufs);
-	for (bn = fs->next; bn != &fs->buflist;  bn = bn->next)
+	printf(" %d bufs, %d hash chains:\n", fs->nbufs, fs->hashsize);
+	for (bn = fs->buflist.next; bn != &fs->buflist;  bn = bn->next)
 	{
 		bp = bufnode_buf(bn);
 		printf("%x: blk %x, size %x \"",
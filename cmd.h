@@ -77,6 +77,7 @@
 #define A_X116MOUSE_IN         68
 #define A_PSHELL               69
 #define A_CLR_SEARCH           70
+#define A_GOMATCH              71
 
 /* These values must not conflict with any A_* or EC_* value. */
 #define A_INVALID              100
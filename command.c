@@ -19,6 +19,10 @@
 #include "position.h"
 #include "option.h"
 #include "cmd.h"
+#include <signal.h>
+#ifdef SIGBUS
+#include <setjmp.h>
+#endif
 
 extern int erase_char, erase2_char, kill_char;
 extern int sigs;
@@ -725,7 +729,7 @@ static int mca_char(int c)
 				undo_search(1);
 			} else
 			{
-				if (search(st | SRCH_INCR, pattern, 1) != 0)
+				if (search(st | SRCH_INCR, pattern, 1) != 0 && !incr_search_pending())
 					/* No match, invalid pattern, etc. */
 					undo_search(1);
 			}
@@ -743,6 +747,38 @@ static int mca_char(int c)
 	return (MCA_MORE);
 }
 
+/*
+ * While the user is not typing, go on with an incremental search
+ * which has not searched the whole file yet.
+ */
+static void incr_search_wait(void)
+{
+	int save_updown_match;
+	int r;
+
+	while ((mca == A_F_SEARCH || mca == A_B_SEARCH) && incr_search_pending() &&
+	       ungot == NULL && !tty_ready(0))
+	{
+		r = incr_search_more();
+		if (r < 0)
+			/* A char was typed; read it first. */
+			return;
+		if (r > 0)
+		{
+			if (incr_search_pending())
+				continue;
+			/* No match in the whole file. */
+			undo_search(1);
+		}
+		/* Redraw the search prompt and search string. */
+		save_updown_match = updown_match;
+		cmd_exec();
+		mca_search1();
+		updown_match = save_updown_match;
+		cmd_repaint(NULL);
+	}
+}
+
 /*
  * Discard any buffered file data.
  */
@@ -1190,6 +1226,38 @@ static int forw_loop(int until_hilite)
 	return (A_NOACTION);
 }
 
+#ifdef SIGBUS
+/*
+ * A mapped file which is truncated while we are reading it
+ * causes SIGBUS; the handler abandons the current command
+ * by jumping back to the top of the command loop.
+ * (As in os.c, _setjmp is used if the signal mask can be
+ * restored separately.)
+ */
+#if HAVE__SETJMP && HAVE_SIGSETMASK
+#define SET_JUMP        _setjmp
+#define LONG_JUMP       _longjmp
+#else
+#define SET_JUMP        setjmp
+#define LONG_JUMP       longjmp
+#endif
+static jmp_buf fault_label;
+static int fault_label_set = FALSE;
+#endif
+
+/*
+ * Called from the SIGBUS handler, after ch_mapfault has arranged for
+ * the current file to be read without its mapping.  Abandon the
+ * current command, if the command loop is running.
+ */
+public void command_fault(void)
+{
+#ifdef SIGBUS
+	if (fault_label_set)
+		LONG_JUMP(fault_label, 1);
+#endif
+}
+
 /*
  * Main command processor.
  * Accept and execute commands until a quit command.
@@ -1213,6 +1281,28 @@ public void commands(void)
 	wscroll = (sc_height + 1) / 2;
 	newaction = A_NOACTION;
 
+#ifdef SIGBUS
+	if (SET_JUMP(fault_label))
+	{
+		/*
+		 * We jumped here from the SIGBUS handler.
+		 * Unblock the signal, and redisplay the file
+		 * as it is now.
+		 */
+#if HAVE_SIGPROCMASK
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+#else
+#if HAVE_SIGSETMASK
+		sigsetmask(0);
+#endif
+#endif
+		newaction = A_NOACTION;
+		screen_trashed = 1;
+	}
+	fault_label_set = TRUE;
+#endif
 	for (;;)
 	{
 		clear_mca();
@@ -1243,6 +1333,21 @@ public void commands(void)
 		prompt();
 		if (sigs)
 			continue;
+		if (newaction == A_NOACTION && ungot == NULL && linenum_wait())
+		{
+			/*
+			 * Line numbers we couldn't display before
+			 * have been calculated in the background.
+			 */
+			screen_trashed = 1;
+			continue;
+		}
+		if (newaction == A_NOACTION && ungot == NULL && match_index_wait())
+			/*
+			 * More of the match index is known; 
+			 * show it in the prompt.
+			 */
+			continue;
 		if (newaction == A_NOACTION)
 			c = getcc();
 
@@ -1268,6 +1373,7 @@ public void commands(void)
 					/*
 					 * Need another character.
 					 */
+					incr_search_wait();
 					c = getcc();
 					goto again;
 				case MCA_DONE:
@@ -1568,6 +1674,21 @@ public void commands(void)
 			jump_line_loc((POSITION) number, jump_sline);
 			break;
 
+		case A_GOMATCH:
+			/*
+			 * Go to the N-th line matching the search pattern,
+			 * default the first.
+			 */
+			if (number <= 0)
+				number = 1;
+			cmd_exec();
+			{
+				POSITION pos = match_index_pos(number);
+				if (pos != NULL_POSITION)
+					jump_loc(pos, jump_sline);
+			}
+			break;
+
 		case A_STAT:
 			/*
 			 * Print file name, etc.
@@ -120,6 +120,7 @@ static unsigned char cmdtable[] =
 	'>',0,                          A_GOEND,
 	SK(SK_END),0,                   A_GOEND,
 	'P',0,                          A_GOPOS,
+	ESC,'g',0,                      A_GOMATCH,
 
 	'0',0,                          A_DIGIT,
 	'1',0,                          A_DIGIT,
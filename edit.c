@@ -364,6 +364,12 @@ static void close_file(void)
 		store_pos(curr_ifile, &scrpos);
 		lastmark();
 	}
+	/*
+	 * Stop calculating line numbers, and save the line index
+	 * so line numbers are quickly known if we open this file again.
+	 */
+	close_linenum();
+	clr_match_index();
 	/*
 	 * Close the file descriptor, unless it is a pipe.
 	 */
@@ -658,6 +664,7 @@ public int edit_ifile(IFILE ifile)
 		 */
 		pos_clear();
 		clr_linenum();
+		open_linenum();
 #if HILITE_SEARCH
 		clr_hilite();
 #endif
@@ -388,7 +388,6 @@ public void forw(int n, POSITION pos, int force, int only_last, int nblank)
 		/* lower_left(); {{ considered harmful? }} */
 	}
 	first_time = 0;
-	(void) currline(BOTTOM);
 }
 
 /*
@@ -446,7 +445,6 @@ public void back(int n, POSITION pos, int force, int only_last)
 		overlay_header();
 		lower_left();
 	}
-	(void) currline(BOTTOM);
 }
 
 /*
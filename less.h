@@ -199,6 +199,12 @@ void free();
 #endif
 #endif
 
+/*
+ * memrchr is not declared by some headers unless _GNU_SOURCE is defined;
+ * os.c provides it if the library doesn't.
+ */
+void * memrchr(const void *s, int c, size_t n);
+
 #if HAVE_SNPRINTF
 #define SNPRINTF1(str, size, fmt, v1)             snprintf((str), (size), (fmt), (v1))
 #define SNPRINTF2(str, size, fmt, v1, v2)         snprintf((str), (size), (fmt), (v1), (v2))
@@ -241,6 +247,7 @@ typedef off_t           LINENUM;
 #define MIN_LINENUM_WIDTH   7   /* Default min printing width of a line number */
 #define MAX_LINENUM_WIDTH   16  /* Max width of a line number */
 #define MAX_STATUSCOL_WIDTH 4   /* Max width of the status column */
+#define MAX_BLOCK_SIZE      1024 /* Max size of a file buffer (K) */
 #define MAX_UTF_CHAR_LEN    6   /* Max bytes in one UTF-8 char */
 #define MAX_PRCHAR_LEN      31  /* Max chars in prchar() result */
 
@@ -575,6 +582,8 @@ typedef enum {
 #define CH_POPENED      004
 #define CH_HELPFILE     010
 #define CH_NODATA       020     /* Special case for zero length files */
+#define CH_MAPPED       040     /* File data is read via mmap */
+#define CH_COLD         0100    /* Don't leave file data in system cache */
 
 #define ch_zero()       ((POSITION)0)
 
@@ -610,6 +619,7 @@ struct mlist;
 struct loption;
 struct hilite_tree;
 struct ansi_state;
+struct iovec;
 #include "pattern.h"
 #include "xbuf.h"
 #include "funcs.h"
@@ -64,6 +64,7 @@ static struct lesskey_cmdname cmdnames[] =
 	{ "goto-end-buffered",    A_GOEND_BUF },
 	{ "goto-line",            A_GOLINE },
 	{ "goto-mark",            A_GOMARK },
+	{ "goto-match",           A_GOMATCH },
 	{ "help",                 A_HELP },
 	{ "index-file",           A_INDEX_FILE },
 	{ "invalid",              A_UINVALID },
@@ -306,6 +306,7 @@ static void add_pfx(char ch, int attr)
 public void plinestart(POSITION pos)
 {
 	LINENUM linenum = 0;
+	int approx = FALSE;
 	int i;
 
 	if (linenums == OPT_ONPLUS)
@@ -317,8 +318,9 @@ public void plinestart(POSITION pos)
 		 *    of plinestart to re-seek if necessary. }}
 		 * {{ Since forw_raw_line modifies linebuf, we must
 		 *    do this first, before storing anything in linebuf. }}
+		 * If it is still being calculated, show an estimate.
 		 */
-		linenum = find_linenum(pos);
+		linenum = est_linenum(pos, &approx);
 	}
 
 	/*
@@ -354,7 +356,10 @@ public void plinestart(POSITION pos)
 			len = 0;
 		else
 		{
-			linenumtoa(linenum, buf, 10);
+			if (approx)
+				est_linenumtoa(linenum, buf, (int) sizeof(buf));
+			else
+				linenumtoa(linenum, buf, 10);
 			len = (int) strlen(buf);
 		}
 		for (i = 0; i < linenum_width - len; i++)
@@ -1335,42 +1340,58 @@ public void null_line(void)
 public POSITION forw_raw_line(POSITION curr_pos, char **linep, int *line_lenp)
 {
 	int n;
-	int c;
-	POSITION new_pos;
+	int len;
+	int take;
+	int full;
+	unsigned char *p;
+	unsigned char *nl;
 
 	if (curr_pos == NULL_POSITION || ch_seek(curr_pos) ||
-		(c = ch_forw_get()) == EOI)
+		(len = ch_forw_span(&p)) == 0)
 		return (NULL_POSITION);
 
+	/*
+	 * Copy spans of the file up to the newline.
+	 * If the caller doesn't want the line, just skip over it.
+	 */
 	n = 0;
+	full = FALSE;
 	for (;;)
 	{
-		if (c == '\n' || c == EOI || ABORT_SIGS())
+		nl = (unsigned char *) memchr(p, '\n', len);
+		take = (nl != NULL) ? (int) (nl - p) : len;
+		if (linep != NULL || line_lenp != NULL)
 		{
-			new_pos = ch_tell();
-			break;
-		}
-		if (n >= size_linebuf-1)
-		{
-			if (expand_linebuf())
+			while (n + take >= size_linebuf && !full)
+				if (expand_linebuf())
+					full = TRUE;
+			if (full)
 			{
 				/*
 				 * Overflowed the input buffer.
 				 * Pretend the line ended here.
 				 */
-				new_pos = ch_tell() - 1;
-				break;
+				take = size_linebuf-1 - n;
+				nl = NULL;
 			}
+			memcpy(&linebuf.buf[n], p, take);
+			n += take;
 		}
-		linebuf.buf[n++] = c;
-		c = ch_forw_get();
+		/* Skip the data, and the newline if we found one. */
+		ch_skip((nl != NULL) ? take + 1 : take);
+		if (nl != NULL || full || ABORT_SIGS())
+			break;
+		len = ch_forw_span(&p);
+		if (len == 0)
+			break;
 	}
-	linebuf.buf[n] = '\0';
+	if (linep != NULL || line_lenp != NULL)
+		linebuf.buf[n] = '\0';
 	if (linep != NULL)
 		*linep = linebuf.buf;
 	if (line_lenp != NULL)
 		*line_lenp = n;
-	return (new_pos);
+	return (ch_tell());
 }
 
 /*
@@ -1380,28 +1401,27 @@ public POSITION forw_raw_line(POSITION curr_pos, char **linep, int *line_lenp)
 public POSITION back_raw_line(POSITION curr_pos, char **linep, int *line_lenp)
 {
 	int n;
-	int c;
+	int len;
+	int take;
+	unsigned char *p;
+	unsigned char *nl;
+	int full = FALSE;
 	POSITION new_pos;
 
 	if (curr_pos == NULL_POSITION || curr_pos <= ch_zero() ||
 		ch_seek(curr_pos-1))
 		return (NULL_POSITION);
 
+	/*
+	 * Copy spans of the file, working backward to the newline
+	 * which ends the previous line.
+	 */
 	n = size_linebuf;
 	linebuf.buf[--n] = '\0';
 	for (;;)
 	{
-		c = ch_back_get();
-		if (c == '\n' || ABORT_SIGS())
-		{
-			/*
-			 * This is the newline ending the previous line.
-			 * We have hit the beginning of the line.
-			 */
-			new_pos = ch_tell() + 1;
-			break;
-		}
-		if (c == EOI)
+		len = ch_back_span(&p);
+		if (len == 0)
 		{
 			/*
 			 * We have hit the beginning of the file.
@@ -1411,30 +1431,40 @@ public POSITION back_raw_line(POSITION curr_pos, char **linep, int *line_lenp)
 			new_pos = ch_zero();
 			break;
 		}
-		if (n <= 0)
+		nl = (unsigned char *) memrchr(p, '\n', len);
+		take = (nl != NULL) ? (int) (p + len - (nl + 1)) : len;
+		while (take > n && !full)
 		{
 			int old_size_linebuf = size_linebuf;
-			char *fm;
-			char *to;
 			if (expand_linebuf())
 			{
 				/*
 				 * Overflowed the input buffer.
 				 * Pretend the line ended here.
 				 */
-				new_pos = ch_tell() + 1;
+				full = TRUE;
+				take = n;
 				break;
 			}
 			/*
 			 * Shift the data to the end of the new linebuf.
 			 */
-			for (fm = linebuf.buf + old_size_linebuf - 1,
-			      to = linebuf.buf + size_linebuf - 1;
-			     fm >= linebuf.buf;  fm--, to--)
-				*to = *fm;
-			n = size_linebuf - old_size_linebuf;
+			memmove(linebuf.buf + size_linebuf - old_size_linebuf,
+				linebuf.buf, old_size_linebuf);
+			n += size_linebuf - old_size_linebuf;
+		}
+		n -= take;
+		memcpy(&linebuf.buf[n], p + len - take, take);
+		ch_skip(-take);
+		if (nl != NULL || full || ABORT_SIGS())
+		{
+			/*
+			 * We have hit the beginning of the line, 
+			 * or we are pretending that we have.
+			 */
+			new_pos = ch_tell();
+			break;
 		}
-		linebuf.buf[--n] = c;
 	}
 	if (linep != NULL)
 		*linep = &linebuf.buf[n];
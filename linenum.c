@@ -26,14 +26,55 @@
  * 101 because 101 can be derived very cheaply from 100, while
  * 200 is more expensive to derive from 100.
  *
- * The function currline() returns the line number of a given
- * position in the file.  As a side effect, it calls add_lnum
- * to cache the line number.  Therefore currline is occasionally
- * called to make sure we cache line numbers often enough.
+ * In addition, whenever we count lines forward through the file
+ * we record the position of every LNUM_STEP'th line in a growable 
+ * array, the line index.  The index covers the file from its start
+ * up to the furthest point counted so far, so for any position in 
+ * that part of the file a binary search finds a known line number 
+ * at most LNUM_STEP lines away, however big the file is.
  */
 
 #include "less.h"
 
+/*
+ * Counting newlines is done a vector at a time where the compiler
+ * lets us use SSE2 (always present on x86-64) and, if the CPU 
+ * supports it at run time, AVX2.  Otherwise it is done a word at a time.
+ */
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SSE2 1
+#include <emmintrin.h>
+#if (__GNUC__ >= 5 || defined(__clang__))
+#define USE_AVX2 1
+#include <immintrin.h>
+#else
+#define USE_AVX2 0
+#endif
+#else
+#define USE_SSE2 0
+#define USE_AVX2 0
+#endif
+
+/*
+ * In a large seekable file, the line index can be extended by a 
+ * pool of threads, each counting the newlines in a different part 
+ * of the file (see lnidx_extend).
+ */
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE && HAVE_PREAD && !MSDOS_COMPILER
+#define USE_PARCOUNT 1
+#include <pthread.h>
+#include <signal.h>
+#else
+#define USE_PARCOUNT 0
+#endif
+
+#if HAVE_STAT_INO && HAVE_MKSTEMP && !MSDOS_COMPILER
+#define USE_LNIDX_CACHE 1
+#include <sys/stat.h>
+#else
+#define USE_LNIDX_CACHE 0
+#endif
+
 /*
  * Structure to keep track of a line number and the associated file position.
  * A doubly-linked circular list of line numbers is kept ordered by line number.
@@ -56,21 +97,506 @@ struct linenum_info
  */
 
 #define NPOOL   200                     /* Size of line number pool */
+#define LNUM_STEP       256             /* Lines between line index entries */
 
 #define LONGTIME        (2)             /* In seconds */
+#define EST_SAMPLE      ((POSITION) (64*1024)) /* Bytes sampled to estimate line length */
+#define CUR_NEAR_SIZE   ((POSITION) (32*1024)) /* About a screenful */
+
+#if USE_PARCOUNT
+#if LESSTEST
+/* A lesstest session can make the chunks smaller; see init_linenum. */
+static POSITION par_chunk_size = (POSITION) (2*1024*1024);
+#define PAR_CHUNK       par_chunk_size
+#define PAR_MIN_SIZE    (16*par_chunk_size)
+#define BG_NEAR_SIZE    (par_chunk_size/8)
+#else
+#define PAR_CHUNK       ((POSITION) (2*1024*1024)) /* Bytes counted by a thread at a time */
+#define PAR_MIN_SIZE    ((POSITION) (32*1024*1024)) /* Don't use threads for less than this */
+#define BG_NEAR_SIZE    ((POSITION) (256*1024)) /* Count this far rather than wait for the background */
+#endif
+#define PAR_MAX_THREADS 32
+#define BG_POLL_MS      100             /* How often to look at background progress */
+#endif
 
 static struct linenum_info anchor;      /* Anchor of the list */
 static struct linenum_info *freelist;   /* Anchor of the unused entries */
 static struct linenum_info pool[NPOOL]; /* The pool itself */
 static struct linenum_info *spare;              /* We always keep one spare entry */
 
+/*
+ * The line index: lnidx[i] is the position of line i*LNUM_STEP+1.
+ * Entries 0 to nlnidx-1 are known; lnidx_next is the line
+ * whose position would be the next entry (or 0 if we have run
+ * out of memory for the index).
+ */
+static POSITION *lnidx = NULL;
+static LINENUM nlnidx = 0;
+static LINENUM maxlnidx = 0;
+static LINENUM lnidx_next = 1;
+/*
+ * A sample of the file near the last estimated line number:
+ * est_slen bytes before est_spos, containing est_snl newlines.
+ */
+static POSITION est_spos = NULL_POSITION;
+static POSITION est_slen;
+static LINENUM est_snl;
+/*
+ * The line found by the last lookup (see lookup_linenum).
+ */
+static POSITION cur_pos = NULL_POSITION;
+static LINENUM cur_line;
+#if USE_PARCOUNT
+static int bg_started = FALSE;          /* Background counting has been tried */
+static POSITION bg_wanted = NULL_POSITION; /* Line number to display when known */
+#endif
+
 extern int linenums;
 extern int sigs;
+extern int secure;
 extern int sc_height;
 extern int screen_trashed;
 extern int header_lines;
 extern int nonum_headers;
 
+#if USE_PARCOUNT
+static void pc_stop(void);
+#endif
+
+/*
+ * Add a line to the line index, if it is the next one it needs.
+ */
+static void lnidx_add(LINENUM linenum, POSITION pos)
+{
+	POSITION *p;
+	LINENUM n;
+
+	if (linenum != lnidx_next)
+		return;
+	if (nlnidx >= maxlnidx)
+	{
+		n = (maxlnidx == 0) ? 1024 : maxlnidx * 2;
+		p = (POSITION *) realloc(lnidx, n * sizeof(POSITION));
+		if (p == NULL)
+		{
+			/* Just stop indexing. */
+			lnidx_next = 0;
+			return;
+		}
+		lnidx = p;
+		maxlnidx = n;
+	}
+	lnidx[nlnidx++] = pos;
+	lnidx_next += LNUM_STEP;
+}
+
+/*
+ * Return the number of the last entry in the line index 
+ * whose position is at or before a given position.
+ */
+static LINENUM lnidx_find(POSITION pos)
+{
+	LINENUM lo = 0;
+	LINENUM hi = nlnidx - 1;
+	LINENUM mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo + 1) / 2;
+		if (lnidx[mid] <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return (lo);
+}
+
+#if USE_LNIDX_CACHE
+/*
+ * The line index of a large regular file is saved in a cache file
+ * when the file is closed, and loaded when it is opened again, so
+ * line numbers are known at once even in a huge file.
+ * The cache file is named by the device and i-number of the file,
+ * and is only used if the start of the file, and the data before the
+ * last index entry, are the same as when it was saved.  So if data
+ * has only been appended to the file, the index is still used
+ * (and is extended as usual); otherwise it is ignored.
+ */
+#define LNIDX_MAGIC     "LessIdx2"
+#define LNIDX_ORDER     0x01020304
+#define LNIDX_SUM_LEN   4096
+#define LNIDX_SAVE_MIN  ((POSITION) (16*1024*1024)) /* Don't save the index of a smaller file */
+
+struct lnidx_header
+{
+	char magic[8];          /* LNIDX_MAGIC */
+	int hdrsize;            /* sizeof(struct lnidx_header) */
+	int order;              /* LNIDX_ORDER, to check the byte order */
+	int step;               /* LNUM_STEP */
+	int possize;            /* sizeof(POSITION) */
+	dev_t dev;              /* Device of the file */
+	ino_t ino;              /* I-number of the file */
+	POSITION size;          /* Size of the file */
+	time_t mtime;           /* Modification time of the file */
+	LINENUM nent;           /* Number of index entries which follow */
+	unsigned long headsum;  /* Checksum of the start of the file */
+	unsigned long tailsum;  /* Checksum of the data before the last entry */
+};
+
+static LINENUM lnidx_saved = 0; /* Entries in the index when loaded */
+
+/*
+ * Return a checksum of the len bytes of the file
+ * before position pos, or 0 if they can't be read.
+ */
+static unsigned long lnidx_sum(POSITION pos, POSITION len)
+{
+	unsigned long sum = 2166136261UL;
+	unsigned char *s;
+	int n;
+
+	if (len > pos - ch_zero())
+		len = pos - ch_zero();
+	if (ch_seek(pos - len))
+		return (0);
+	while (len > 0)
+	{
+		n = ch_forw_span(&s);
+		if (n == 0)
+			return (0);
+		if (n > len)
+			n = (int) len;
+		ch_skip(n);
+		len -= n;
+		while (n-- > 0)
+			sum = (sum ^ *s++) * 16777619UL;
+	}
+	return (sum);
+}
+
+/*
+ * Return the name of the cache file for a file,
+ * or NULL if the line index should not be cached.
+ */
+static char * lnidx_cachename(struct stat *st, int mkdirs)
+{
+	char *dir;
+	char *cache;
+	char *name;
+	char leaf[64];
+
+	if (secure)
+		return (NULL);
+	dir = lgetenv("LESSINDEXDIR");
+	if (!isnullenv(dir))
+	{
+		if (strcmp(dir, "-") == 0)
+			return (NULL);
+		dir = save(dir);
+	} else
+	{
+		/* Use $XDG_CACHE_HOME/less, or $HOME/.cache/less. */
+		dir = dirfile(lgetenv("XDG_CACHE_HOME"), "less", 0);
+		if (dir == NULL)
+		{
+			cache = dirfile(lgetenv("HOME"), ".cache", 0);
+			if (cache == NULL)
+				return (NULL);
+			if (mkdirs)
+				(void) mkdir(cache, 0700);
+			dir = dirfile(cache, "less", 0);
+			free(cache);
+			if (dir == NULL)
+				return (NULL);
+		}
+	}
+	if (mkdirs)
+		(void) mkdir(dir, 0700);
+	SNPRINTF2(leaf, sizeof(leaf), "%llx-%llx.lnidx",
+		(unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+	name = dirfile(dir, leaf, 0);
+	free(dir);
+	return (name);
+}
+
+/*
+ * Is a loaded line index usable: does each entry come after the one
+ * before it, and none after the end of the file (of size size)?
+ */
+static int lnidx_valid(POSITION *p, LINENUM nent, POSITION size)
+{
+	LINENUM i;
+
+	for (i = 1;  i < nent;  i++)
+		if (p[i] <= p[i-1])
+			return (FALSE);
+	return (p[nent - 1] <= size);
+}
+
+/*
+ * Load the saved line index of the current file, if there is one
+ * and it still describes the file.
+ */
+static void lnidx_load(void)
+{
+	struct lnidx_header hdr;
+	struct stat st;
+	POSITION *p;
+	char *name;
+	int fd;
+	int f;
+	size_t n;
+
+	lnidx_saved = 0;
+	if ((fd = ch_getfd()) < 0 || fstat(fd, &st) < 0)
+		return;
+	if ((POSITION) st.st_size < LNIDX_SAVE_MIN)
+		return;
+	name = lnidx_cachename(&st, FALSE);
+	if (name == NULL)
+		return;
+	f = open(name, OPEN_READ);
+	free(name);
+	if (f < 0)
+		return;
+	if (read(f, &hdr, sizeof(hdr)) != (ssize_t) sizeof(hdr) ||
+	    memcmp(hdr.magic, LNIDX_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.hdrsize != (int) sizeof(hdr) || hdr.order != LNIDX_ORDER ||
+	    hdr.step != LNUM_STEP || hdr.possize != (int) sizeof(POSITION) ||
+	    hdr.dev != st.st_dev || hdr.ino != st.st_ino ||
+	    hdr.size > (POSITION) st.st_size || hdr.nent <= nlnidx ||
+	    (hdr.size == (POSITION) st.st_size && hdr.mtime != st.st_mtime))
+	{
+		close(f);
+		return;
+	}
+	n = (size_t) hdr.nent * sizeof(POSITION);
+	p = (POSITION *) malloc(n);
+	if (p == NULL || read(f, p, n) != (ssize_t) n ||
+	    p[0] != ch_zero() || !lnidx_valid(p, hdr.nent, hdr.size) ||
+	    lnidx_sum(ch_zero() + LNIDX_SUM_LEN, LNIDX_SUM_LEN) != hdr.headsum ||
+	    lnidx_sum(p[hdr.nent - 1], LNIDX_SUM_LEN) != hdr.tailsum)
+	{
+		free(p);
+		close(f);
+		return;
+	}
+	close(f);
+	free(lnidx);
+	lnidx = p;
+	nlnidx = maxlnidx = hdr.nent;
+	lnidx_next = hdr.nent * LNUM_STEP + 1;
+	lnidx_saved = nlnidx;
+}
+/*
+ * Save the line index of the current file,
+ * if it has grown since it was loaded.
+ */
+static void lnidx_save(void)
+{
+	struct lnidx_header hdr;
+	struct stat st;
+	char *name;
+	char *tempname;
+	size_t n;
+	int len;
+	int fd;
+	int f;
+	int ok;
+
+	if (nlnidx <= lnidx_saved || nlnidx <= 1 || lnidx_next == 0)
+		return;
+	if ((fd = ch_getfd()) < 0 || fstat(fd, &st) < 0)
+		return;
+	if ((POSITION) st.st_size < LNIDX_SAVE_MIN)
+		return;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LNIDX_MAGIC, sizeof(hdr.magic));
+	hdr.hdrsize = (int) sizeof(hdr);
+	hdr.order = LNIDX_ORDER;
+	hdr.step = LNUM_STEP;
+	hdr.possize = (int) sizeof(POSITION);
+	hdr.dev = st.st_dev;
+	hdr.ino = st.st_ino;
+	hdr.size = (POSITION) st.st_size;
+	hdr.mtime = st.st_mtime;
+	hdr.nent = nlnidx;
+	hdr.headsum = lnidx_sum(ch_zero() + LNIDX_SUM_LEN, LNIDX_SUM_LEN);
+	hdr.tailsum = lnidx_sum(lnidx[nlnidx - 1], LNIDX_SUM_LEN);
+	if (hdr.headsum == 0 || hdr.tailsum == 0)
+		return;
+	name = lnidx_cachename(&st, TRUE);
+	if (name == NULL)
+		return;
+	/*
+	 * Write a new file and rename it, so another less
+	 * never sees a partly written index.
+	 * mkstemp makes sure we don't write through a link
+	 * someone else has put in the directory.
+	 */
+	len = (int) strlen(name) + 16;
+	tempname = (char *) ecalloc(len, sizeof(char));
+	SNPRINTF1(tempname, len, "%s.XXXXXX", name);
+	f = mkstemp(tempname);
+	if (f >= 0)
+	{
+		n = (size_t) nlnidx * sizeof(POSITION);
+		ok = (write(f, &hdr, sizeof(hdr)) == (ssize_t) sizeof(hdr) &&
+		      write(f, lnidx, n) == (ssize_t) n);
+		if (close(f) < 0)
+			ok = FALSE;
+		if (ok && rename(tempname, name) == 0)
+			lnidx_saved = nlnidx;
+		else
+			unlink(tempname);
+	}
+	free(tempname);
+	free(name);
+}
+#endif
+
+#if USE_AVX2
+/*
+ * Count newlines 32 bytes at a time, from s until end is reached
+ * or the next 32 bytes would take the count to n.
+ * Return where we stopped.
+ */
+__attribute__((target("avx2")))
+static unsigned char * count_nl_avx2(unsigned char *s, unsigned char *end, LINENUM n, LINENUM *countp)
+{
+	__m256i nlv = _mm256_set1_epi8('\n');
+	LINENUM count = *countp;
+	int c;
+
+	while (end - s >= 32)
+	{
+		c = __builtin_popcount((unsigned int) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *) s), nlv)));
+		if (count + c >= n)
+			break;
+		count += c;
+		s += 32;
+	}
+	*countp = count;
+	return (s);
+}
+#endif
+
+/*
+ * Find the n'th newline in the len bytes at s.
+ * Return a pointer to the character after it; or if there are 
+ * fewer than n (or n <= 0), return NULL and set *countp to the 
+ * number of newlines there are.
+ */
+static unsigned char * find_nl(unsigned char *s, int len, LINENUM n, LINENUM *countp)
+{
+	unsigned char *end = s + len;
+	LINENUM count = 0;
+	int c;
+#if USE_AVX2
+	static int have_avx2 = -1;
+#endif
+#if USE_SSE2
+	__m128i nlv;
+#else
+	unsigned long long w;
+	unsigned long long x;
+#endif
+
+	if (n <= 0)
+		n = (LINENUM) len + 1;
+#if USE_AVX2
+	if (have_avx2 < 0)
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	if (have_avx2)
+		s = count_nl_avx2(s, end, n, &count);
+#endif
+#if USE_SSE2
+	nlv = _mm_set1_epi8('\n');
+	while (end - s >= 16)
+	{
+		c = __builtin_popcount((unsigned int) _mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) s), nlv)));
+		if (count + c >= n)
+			break;
+		count += c;
+		s += 16;
+	}
+#else
+	while (end - s >= 8)
+	{
+		/*
+		 * Set the high bit of each byte of x which is a newline,
+		 * then add up those bits.
+		 */
+		memcpy(&w, s, 8);
+		w ^= 0x0a0a0a0a0a0a0a0aULL;
+		x = (w & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL;
+		x = ~(x | w | 0x7f7f7f7f7f7f7f7fULL);
+		c = (int) (((x >> 7) * 0x0101010101010101ULL) >> 56);
+		if (count + c >= n)
+			break;
+		count += c;
+		s += 8;
+	}
+#endif
+	for (;  s < end;  s++)
+	{
+		if (*s == '\n' && ++count == n)
+			return (s + 1);
+	}
+	*countp = count;
+	return (NULL);
+}
+
+/*
+ * Count the newlines in the len bytes at s, which are at file position
+ * spos, and add any line index entries we pass.
+ * *linenump is the number of the line containing s, and is updated.
+ * If there are any newlines, *cposp is set to the position after the last.
+ */
+static void count_lines(unsigned char *s, int len, POSITION spos, LINENUM *linenump, POSITION *cposp)
+{
+	unsigned char *t = s;
+	unsigned char *end = s + len;
+	unsigned char *nl;
+	LINENUM n;
+
+	while ((nl = find_nl(t, (int) (end - t), lnidx_next - *linenump, &n)) != NULL)
+	{
+		*linenump = lnidx_next;
+		*cposp = spos + (nl - s);
+		lnidx_add(*linenump, *cposp);
+		t = nl;
+	}
+	if (n > 0)
+	{
+		*linenump += n;
+		nl = (unsigned char *) memrchr(t, '\n', (size_t) (end - t));
+		*cposp = spos + (nl + 1 - s);
+	}
+}
+
+/*
+ * Initialize line numbering, once at startup.
+ */
+public void init_linenum(void)
+{
+#if LESSTEST && USE_PARCOUNT
+	char *s;
+	POSITION n;
+
+	/*
+	 * The files in lesstest sessions are too small to be counted
+	 * by threads.  LESSTEST_CHUNK=n makes the chunks n bytes long,
+	 * so that a file of 16 chunks or more is.
+	 */
+	s = lgetenv("LESSTEST_CHUNK");
+	if (!isnullenv(s) && (n = lstrtopos(s, NULL, 10)) > 0)
+		par_chunk_size = n;
+#endif
+}
+
 /*
  * Initialize the line number structures.
  */
@@ -78,6 +604,15 @@ public void clr_linenum(void)
 {
 	struct linenum_info *p;
 
+#if USE_PARCOUNT
+	/*
+	 * Stop counting lines in the background.
+	 */
+	pc_stop();
+	bg_started = FALSE;
+	bg_wanted = NULL_POSITION;
+#endif
+
 	/*
 	 * Put all the entries on the free list.
 	 * Leave one for the "spare".
@@ -96,6 +631,15 @@ public void clr_linenum(void)
 	anchor.gap = 0;
 	anchor.pos = (POSITION)0;
 	anchor.line = 1;
+	est_spos = NULL_POSITION;
+	cur_pos = NULL_POSITION;
+
+	/*
+	 * Empty the line index, except for line 1.
+	 */
+	nlnidx = 0;
+	lnidx_next = 1;
+	lnidx_add(1, ch_zero());
 }
 
 /*
@@ -127,6 +671,8 @@ public void add_lnum(LINENUM linenum, POSITION pos)
 	struct linenum_info *prevp;
 	POSITION mingap;
 
+	lnidx_add(linenum, pos);
+
 	/*
 	 * Find the proper place in the list for the new one.
 	 * The entries are sorted by position.
@@ -252,15 +798,413 @@ static void abort_long(void)
 	error("Line numbers turned off", NULL_PARG);
 }
 
+#if USE_PARCOUNT
+/*
+ * State shared by the threads extending the line index.
+ * The file is divided into chunks, each ending at a multiple of
+ * PAR_CHUNK.  Each thread takes the next chunk, reads it with pread
+ * and counts its newlines.  Once the counts of all the chunks before
+ * it are known, and hence the number of the first line in it,
+ * the thread finds the positions of the line index entries in it.
+ * Meanwhile the main thread adds the entries of each chunk
+ * to the index, in order (see pc_merge).
+ * The threads may be left running in the background, in which 
+ * case the main thread adds the entries whenever it looks up 
+ * a line number, or while it waits for a command (see linenum_wait).
+ */
+struct pcchunk
+{
+	POSITION pos;           /* File position of the chunk */
+	int len;                /* Length of the chunk */
+	int state;              /* PC_... */
+	LINENUM count;          /* Newlines in the chunk */
+	LINENUM base;           /* Newlines before the chunk */
+	POSITION *ent;          /* Line index entries in the chunk */
+	LINENUM nent;           /* Number of entries */
+};
+#define PC_TODO         0
+#define PC_COUNTED      1
+#define PC_DONE         2
+#define PC_FAILED       3
+
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pcchunk *chunks;
+	int nchunks;
+	int nextchunk;          /* Next chunk for a thread to take */
+	int nbased;             /* Chunks before this one have a known base */
+	int stop;               /* Threads should stop */
+	int fd;                 /* File to read */
+	int cold;               /* Drop data from the system cache */
+	int active;             /* Are the threads running? */
+	int background;         /* Leave them running when we don't need them? */
+	int nthreads;
+	pthread_t threads[PAR_MAX_THREADS];
+	unsigned char *bufs[PAR_MAX_THREADS];
+	int merged;             /* Chunks added to the line index */
+	LINENUM nextline;       /* Line of the next entry to add */
+	POSITION epos;          /* End of the last chunk */
+	POSITION mpos;          /* End of the chunks added to the line index */
+} pc;
+
+/*
+ * Mark a chunk as done (or failed) and wake up anyone waiting for it.
+ */
+static void pc_finish(struct pcchunk *cp, int state)
+{
+	pthread_mutex_lock(&pc.lock);
+	cp->state = state;
+	if (state == PC_FAILED)
+		pc.stop = TRUE;
+	pthread_cond_broadcast(&pc.cond);
+	pthread_mutex_unlock(&pc.lock);
+}
+
+/*
+ * Count the newlines in one chunk and find its line index entries.
+ */
+static void pc_chunk(struct pcchunk *cp, unsigned char *buf)
+{
+	unsigned char *t;
+	LINENUM count;
+	LINENUM n;
+	LINENUM i;
+	ssize_t r;
+	int len;
+
+	for (len = 0;  len < cp->len;  len += (int) r)
+	{
+		r = pread(pc.fd, buf + len, (size_t) (cp->len - len), (off_t) (cp->pos + len));
+		if (r <= 0)
+		{
+			/* The file has shrunk, or can't be read. */
+			pc_finish(cp, PC_FAILED);
+			return;
+		}
+	}
+#if HAVE_POSIX_FADVISE && defined(POSIX_FADV_DONTNEED)
+	if (pc.cold)
+		(void) posix_fadvise(pc.fd, (off_t) cp->pos, (off_t) len, POSIX_FADV_DONTNEED);
+#endif
+	(void) find_nl(buf, len, 0, &count);
+
+	/*
+	 * Publish the count, and wait until we know the base.
+	 */
+	pthread_mutex_lock(&pc.lock);
+	cp->count = count;
+	cp->state = PC_COUNTED;
+	while (pc.nbased < pc.nchunks && pc.chunks[pc.nbased-1].state == PC_COUNTED)
+	{
+		pc.chunks[pc.nbased].base = pc.chunks[pc.nbased-1].base + pc.chunks[pc.nbased-1].count;
+		pc.nbased++;
+	}
+	pthread_cond_broadcast(&pc.cond);
+	while (cp - pc.chunks >= pc.nbased && !pc.stop)
+		pthread_cond_wait(&pc.cond, &pc.lock);
+	if (cp - pc.chunks >= pc.nbased)
+	{
+		/* Stopped before we could finish. */
+		cp->state = PC_FAILED;
+		pthread_cond_broadcast(&pc.cond);
+		pthread_mutex_unlock(&pc.lock);
+		return;
+	}
+	pthread_mutex_unlock(&pc.lock);
+
+	/*
+	 * There is an index entry after newline number base+n
+	 * if base+n is a multiple of LNUM_STEP.
+	 */
+	cp->nent = (cp->base + count) / LNUM_STEP - cp->base / LNUM_STEP;
+	if (cp->nent > 0)
+	{
+		cp->ent = (POSITION *) malloc(cp->nent * sizeof(POSITION));
+		if (cp->ent == NULL)
+		{
+			pc_finish(cp, PC_FAILED);
+			return;
+		}
+		n = LNUM_STEP - cp->base % LNUM_STEP;
+		for (t = buf, i = 0;  i < cp->nent;  i++, n = LNUM_STEP)
+		{
+			t = find_nl(t, len - (int) (t - buf), n, &count);
+			cp->ent[i] = cp->pos + (t - buf);
+		}
+	}
+	pc_finish(cp, PC_DONE);
+}
+
+/*
+ * Main function of a counting thread.
+ */
+static void * pc_thread(void *arg)
+{
+	unsigned char *buf = (unsigned char *) arg;
+	int c;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pc.lock);
+		if (pc.stop || pc.nextchunk >= pc.nchunks)
+		{
+			pthread_mutex_unlock(&pc.lock);
+			break;
+		}
+		c = pc.nextchunk++;
+		pthread_mutex_unlock(&pc.lock);
+		pc_chunk(&pc.chunks[c], buf);
+	}
+	return (NULL);
+}
+
+/*
+ * Stop the threads, and forget the chunks not yet added to the line index.
+ */
+static void pc_stop(void)
+{
+	int c;
+	int i;
+
+	if (!pc.active)
+		return;
+	pthread_mutex_lock(&pc.lock);
+	pc.stop = TRUE;
+	pthread_cond_broadcast(&pc.cond);
+	pthread_mutex_unlock(&pc.lock);
+	for (i = 0;  i < pc.nthreads;  i++)
+	{
+		pthread_join(pc.threads[i], NULL);
+		free(pc.bufs[i]);
+	}
+	for (c = 0;  c < pc.nchunks;  c++)
+		free(pc.chunks[c].ent);
+	free(pc.chunks);
+	pthread_cond_destroy(&pc.cond);
+	pthread_mutex_destroy(&pc.lock);
+	pc.active = FALSE;
+}
+
+/*
+ * Start threads to extend the line index from its last entry
+ * to the end of the file.  In the background, one thread will do;
+ * otherwise it is only worth it if there are several CPUs.
+ * Return FALSE if the file can't be read this way, or it isn't worth it.
+ */
+static int pc_start(int background)
+{
+	sigset_t mask;
+	sigset_t omask;
+	POSITION spos;
+	POSITION cpos;
+	LINENUM n;
+	int fd;
+	int c;
+	int i;
+
+	if (pc.active || nlnidx == 0 || lnidx_next == 0)
+		return (FALSE);
+	if ((fd = ch_getfd()) < 0)
+		return (FALSE);
+	spos = lnidx[nlnidx - 1];
+	pc.epos = ch_length();
+	if (pc.epos - spos < PAR_MIN_SIZE)
+		return (FALSE);
+	pc.nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (pc.nthreads <= 1 && !background)
+		return (FALSE);
+	if (pc.nthreads < 1)
+		pc.nthreads = 1;
+	else if (pc.nthreads > PAR_MAX_THREADS)
+		pc.nthreads = PAR_MAX_THREADS;
+
+	/*
+	 * Divide the rest of the file into chunks.
+	 */
+	pc.nchunks = (int) ((pc.epos - 1) / PAR_CHUNK - spos / PAR_CHUNK + 1);
+	pc.chunks = (struct pcchunk *) calloc(pc.nchunks, sizeof(struct pcchunk));
+	if (pc.chunks == NULL)
+		return (FALSE);
+	for (c = 0, cpos = spos;  c < pc.nchunks;  c++)
+	{
+		pc.chunks[c].pos = cpos;
+		cpos = (cpos / PAR_CHUNK + 1) * PAR_CHUNK;
+		if (cpos > pc.epos)
+			cpos = pc.epos;
+		pc.chunks[c].len = (int) (cpos - pc.chunks[c].pos);
+	}
+	pc.nbased = 1;
+	pc.nextchunk = 0;
+	pc.merged = 0;
+	pc.nextline = lnidx_next;
+	pc.mpos = spos;
+	pc.stop = FALSE;
+	pc.fd = fd;
+	pc.cold = (ch_getflags() & CH_COLD) != 0;
+	pc.background = background;
+	pthread_mutex_init(&pc.lock, NULL);
+	pthread_cond_init(&pc.cond, NULL);
+	/* Make sure find_nl has looked at the CPU before the threads use it. */
+	(void) find_nl((unsigned char *) "", 0, 0, &n);
+
+	/*
+	 * Signals must be handled by this thread, not by the counting threads.
+	 */
+	if (pc.nthreads > pc.nchunks)
+		pc.nthreads = pc.nchunks;
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &omask);
+	for (i = 0;  i < pc.nthreads;  i++)
+	{
+		pc.bufs[i] = (unsigned char *) malloc((size_t) PAR_CHUNK);
+		if (pc.bufs[i] == NULL)
+			break;
+		if (pthread_create(&pc.threads[i], NULL, pc_thread, pc.bufs[i]) != 0)
+		{
+			free(pc.bufs[i]);
+			break;
+		}
+	}
+	pc.nthreads = i;
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	pc.active = TRUE;
+	if (pc.nthreads == 0)
+	{
+		pc_stop();
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+/*
+ * Add the entries of the chunks which are done to the line index,
+ * in order.  If wait is TRUE and the next chunk is not done yet,
+ * first wait for it.  Stop the threads when all chunks are done,
+ * or one has failed.
+ * The index may have been extended meanwhile by counting lines in
+ * this thread, so we only add the entries past the end of the index.
+ */
+static void pc_merge(int wait)
+{
+	struct pcchunk *cp;
+	LINENUM n;
+	int state;
+
+	while (pc.active)
+	{
+		if (pc.merged >= pc.nchunks)
+		{
+			pc_stop();
+			break;
+		}
+		cp = &pc.chunks[pc.merged];
+		pthread_mutex_lock(&pc.lock);
+		while (wait && cp->state != PC_DONE && cp->state != PC_FAILED)
+			pthread_cond_wait(&pc.cond, &pc.lock);
+		state = cp->state;
+		pthread_mutex_unlock(&pc.lock);
+		if (state == PC_FAILED || lnidx_next == 0)
+		{
+			pc_stop();
+			break;
+		}
+		if (state != PC_DONE)
+			break;
+		for (n = 0;  n < cp->nent;  n++, pc.nextline += LNUM_STEP)
+			if (pc.nextline == lnidx_next)
+				lnidx_add(pc.nextline, cp->ent[n]);
+		free(cp->ent);
+		cp->ent = NULL;
+		pc.mpos = cp->pos + cp->len;
+		pc.merged++;
+		wait = FALSE;
+	}
+}
+
+/*
+ * Extend the line index from its last entry, using several threads,
+ * until it reaches position pos or line linenum (whichever is not
+ * NULL_POSITION or 0), or the end of the file.
+ * If threads are already counting lines in the background,
+ * just wait for them to get there.
+ * Do nothing if the file can't be read this way or it isn't worth it,
+ * and leave the caller to count the lines itself.
+ * Return -1 if interrupted.
+ */
+static int lnidx_extend(POSITION pos, LINENUM linenum, char *msg)
+{
+	PARG parg[2];
+	int pct = -1;
+	int ret = 0;
+#if HAVE_TIME
+	time_type stime = get_time();
+#endif
+
+	if (!pc.active)
+	{
+		if (pos != NULL_POSITION && nlnidx > 0 && pos - lnidx[nlnidx - 1] < PAR_MIN_SIZE)
+			return (0);
+		if (!pc_start(FALSE))
+			return (0);
+	}
+	for (;;)
+	{
+		pc_merge(TRUE);
+		if (!pc.active ||
+		    (pos != NULL_POSITION && pc.mpos >= pos) ||
+		    (linenum != 0 && lnidx_next > linenum))
+			break;
+		if (ABORT_SIGS())
+		{
+			ret = -1;
+			break;
+		}
+#if HAVE_TIME
+		if (get_time() < stime + LONGTIME)
+			continue;
+#endif
+		if (percentage(pc.mpos, pc.epos) != pct)
+		{
+			pct = percentage(pc.mpos, pc.epos);
+			parg[0].p_string = msg;
+			parg[1].p_int = pct;
+			ierror("%s (%d%%)", parg);
+			loopcount = -1;
+		}
+	}
+	if (!pc.background)
+		pc_stop();
+	return (ret);
+}
+#endif
+
 /*
  * Find the line number associated with a given position.
+ * If wait is FALSE and the line number is still being
+ * calculated in the background, don't wait for it.
  * Return 0 if we can't figure it out.
  */
-public LINENUM find_linenum(POSITION pos)
+static LINENUM lookup_linenum(POSITION pos, int wait)
 {
 	struct linenum_info *p;
 	LINENUM linenum;
+	LINENUM i;
+	LINENUM pline;
+	POSITION ppos;
+	LINENUM nline;
+	POSITION npos;
 	POSITION cpos;
+	POSITION spos;
+	POSITION n;
+	unsigned char *s;
+	unsigned char *t;
+	unsigned char *nl;
+	int len;
+	int forward;
+	int from_cur;
+	int at_eof = FALSE;
 
 	if (!linenums)
 		/*
@@ -278,56 +1222,201 @@ public LINENUM find_linenum(POSITION pos)
 		 */
 		return (1);
 
+#if USE_PARCOUNT
 	/*
-	 * Find the entry nearest to the position we want.
+	 * The first time we need a line number in a large file,
+	 * start counting its lines in the background.
 	 */
-	for (p = anchor.next;  p != &anchor && p->pos < pos;  p = p->next)
-		continue;
-	if (p->pos == pos)
-		/* Found it exactly. */
-		return (p->line);
+	if (!bg_started)
+	{
+		bg_started = TRUE;
+		(void) pc_start(TRUE);
+	}
+	if (pc.active)
+		pc_merge(FALSE);
+#endif
+
+	/*
+	 * Lines are mostly looked up in sequence: the lines of the screen
+	 * as it is painted forward or backward, or the new lines of a 
+	 * growing file as it is followed.  So if pos is near the line found 
+	 * last time, or after it and it is the furthest line known, 
+	 * just count from there without searching.
+	 */
+	if (pos == cur_pos)
+		return (cur_line);
+	if (cur_pos == NULL_POSITION)
+		from_cur = FALSE;
+	else if (pos < cur_pos)
+		from_cur = (cur_pos - pos <= CUR_NEAR_SIZE);
+	else
+		from_cur = (pos - cur_pos <= CUR_NEAR_SIZE ||
+			(cur_pos >= anchor.prev->pos &&
+			 (nlnidx == 0 || cur_pos >= lnidx[nlnidx - 1])));
+	if (from_cur)
+	{
+		forward = (pos > cur_pos);
+		pline = nline = cur_line;
+		ppos = npos = cur_pos;
+	} else
+	{
+		/*
+		 * Find the entry nearest to the position we want.
+		 */
+		for (p = anchor.next;  p != &anchor && p->pos < pos;  p = p->next)
+			continue;
+		if (p->pos == pos)
+		{
+			/* Found it exactly. */
+			cur_pos = pos;
+			cur_line = p->line;
+			return (p->line);
+		}
+		/*
+		 * The line before pos may be nearer in the line index.
+		 */
+		pline = p->prev->line;
+		ppos = p->prev->pos;
+		if (nlnidx > 0)
+		{
+			i = lnidx_find(pos);
+			if (lnidx[i] == pos)
+			{
+				cur_pos = pos;
+				cur_line = i * LNUM_STEP + 1;
+				return (cur_line);
+			}
+			if (lnidx[i] > ppos)
+			{
+				pline = i * LNUM_STEP + 1;
+				ppos = lnidx[i];
+			}
+		}
+		/*
+		 * Decide whether we should go forward from the 
+		 * previous one or backwards from the next one.
+		 * The decision is based on which way involves 
+		 * traversing fewer bytes in the file.
+		 */
+		forward = (p == &anchor || pos - ppos < p->pos - pos);
+		nline = p->line;
+		npos = p->pos;
+	}
 
 	/*
 	 * This is the (possibly) time-consuming part.
 	 * We start at the line we just found and start
 	 * reading the file forward or backward till we
 	 * get to the place we want.
-	 *
-	 * First decide whether we should go forward from the 
-	 * previous one or backwards from the next one.
-	 * The decision is based on which way involves 
-	 * traversing fewer bytes in the file.
 	 */
 #if HAVE_TIME
 	startime = get_time();
 #endif
 	loopcount = 0;
-	if (p == &anchor || pos - p->prev->pos < p->pos - pos)
+	if (forward)
 	{
 		/*
 		 * Go forward.
 		 */
-		p = p->prev;
-		if (ch_seek(p->pos))
+#if USE_PARCOUNT
+		/*
+		 * If we are starting from the end of the line index
+		 * and have far to go, the line index may be extended 
+		 * faster in parallel, or may already be being extended
+		 * in the background.
+		 */
+		if (nlnidx > 0 && ppos >= lnidx[nlnidx - 1] && pos - ppos > BG_NEAR_SIZE)
+		{
+			if (pc.active && !wait)
+			{
+				/* linenum_wait tells the caller when it is known. */
+				if (bg_wanted == NULL_POSITION || pos < bg_wanted)
+					bg_wanted = pos;
+				return (0);
+			}
+			if (lnidx_extend(pos, 0, "Calculating line numbers") < 0)
+			{
+				abort_long();
+				return (0);
+			}
+			i = lnidx_find(pos);
+			if (lnidx[i] == pos)
+				return (i * LNUM_STEP + 1);
+			pline = i * LNUM_STEP + 1;
+			ppos = lnidx[i];
+		}
+#endif
+		if (ch_seek(ppos))
 			return (0);
-		for (linenum = p->line, cpos = p->pos;  cpos < pos;  linenum++)
+		/*
+		 * Count the newlines in each span of the file
+		 * until we reach the start of a line at or after pos.
+		 */
+		for (linenum = pline, cpos = ppos;  cpos < pos;  )
 		{
+			len = ch_forw_span(&s);
+			if (len == 0)
+			{
+				/*
+				 * End of file.  If the last line has 
+				 * no newline, it ends at end of file.
+				 */
+				if (ch_tell() == cpos)
+					return (0);
+				cpos = ch_tell();
+				linenum++;
+				at_eof = TRUE;
+				break;
+			}
+			spos = ch_tell();
+			/*
+			 * Count the newlines before pos-1; then look for 
+			 * the next one, which ends the line containing pos.
+			 */
+			n = pos - 1 - spos;
+			if (n < 0)
+				n = 0;
+			else if (n > len)
+				n = len;
+			count_lines(s, (int) n, spos, &linenum, &cpos);
+			t = s + n;
+			if (n < len)
+			{
+				nl = (unsigned char *) memchr(t, '\n', (size_t) (len - n));
+				if (nl == NULL)
+					t = s + len;
+				else
+				{
+					t = nl + 1;
+					linenum++;
+					cpos = spos + (t - s);
+					if (linenum == lnidx_next)
+						lnidx_add(linenum, cpos);
+				}
+			}
+			ch_skip(t - s);
 			/*
 			 * Allow a signal to abort this loop.
 			 */
-			cpos = forw_raw_line(cpos, (char **)NULL, (int *)NULL);
 			if (ABORT_SIGS()) {
 				abort_long();
 				return (0);
 			}
-			if (cpos == NULL_POSITION)
-				return (0);
 			longish();
 		}
 		/*
-		 * We might as well cache it.
+		 * Start from this line next time (but not from the end
+		 * of a last line without a newline, which may yet be extended).
+		 * We might as well cache it too, unless we are just
+		 * stepping through lines near each other.
 		 */
-		add_lnum(linenum, cpos);
+		if (!at_eof)
+		{
+			cur_pos = cpos;
+			cur_line = linenum;
+		}
+		if (!from_cur || lnidx_next == 0)
+			add_lnum(linenum, cpos);
 		/*
 		 * If the given position is not at the start of a line,
 		 * make sure we return the correct line number.
@@ -338,32 +1427,212 @@ public LINENUM find_linenum(POSITION pos)
 	{
 		/*
 		 * Go backward.
+		 * Skip the newline which ends the line before npos,
+		 * then look back through each span of the file for 
+		 * newlines until we reach the start of a line at or before pos.
 		 */
-		if (ch_seek(p->pos))
+		if (ch_seek(npos - 1))
 			return (0);
-		for (linenum = p->line, cpos = p->pos;  cpos > pos;  linenum--)
+		for (linenum = nline, cpos = npos;  cpos > pos;  )
 		{
+			len = ch_back_span(&s);
+			if (len == 0)
+			{
+				/*
+				 * Beginning of file.
+				 */
+				cpos = ch_zero();
+				linenum--;
+				break;
+			}
+			spos = ch_tell() - len;
+			for (t = s + len;  t > s;  )
+			{
+				nl = (unsigned char *) memrchr(s, '\n', t - s);
+				if (nl == NULL)
+				{
+					t = s;
+					break;
+				}
+				t = nl;
+				linenum--;
+				cpos = spos + (nl - s) + 1;
+				if (cpos <= pos)
+					break;
+			}
+			ch_skip(-(len - (t - s)));
 			/*
 			 * Allow a signal to abort this loop.
 			 */
-			cpos = back_raw_line(cpos, (char **)NULL, (int *)NULL);
 			if (ABORT_SIGS()) {
 				abort_long();
 				return (0);
 			}
-			if (cpos == NULL_POSITION)
-				return (0);
 			longish();
 		}
-		/*
-		 * We might as well cache it.
-		 */
-		add_lnum(linenum, cpos);
+		cur_pos = cpos;
+		cur_line = linenum;
+		if (!from_cur || lnidx_next == 0)
+			add_lnum(linenum, cpos);
 	}
 	loopcount = 0;
 	return (linenum);
 }
 
+/*
+ * Find the line number associated with a given position.
+ * Return 0 if we can't figure it out.
+ */
+public LINENUM find_linenum(POSITION pos)
+{
+	return (lookup_linenum(pos, TRUE));
+}
+
+/*
+ * Like find_linenum, but return 0 rather than wait for a line number
+ * which is being calculated in the background.  Used for line numbers
+ * which are only displayed, so that commands are never held up.
+ */
+public LINENUM known_linenum(POSITION pos)
+{
+	return (lookup_linenum(pos, FALSE));
+}
+
+/*
+ * Take a sample of the EST_SAMPLE bytes before position pos
+ * (or as much of them as we can read without waiting),
+ * unless we already have one near there.
+ */
+static void est_sample(POSITION pos)
+{
+	unsigned char *s;
+	LINENUM count;
+	POSITION n;
+	int len;
+
+	if (est_spos != NULL_POSITION && 
+	    pos + 4*EST_SAMPLE > est_spos && pos < est_spos + 4*EST_SAMPLE)
+		return;
+	est_spos = pos;
+	est_slen = 0;
+	est_snl = 0;
+	est_slen = pos - ch_zero();
+	if (est_slen > EST_SAMPLE)
+		est_slen = EST_SAMPLE;
+	if (ch_seek(pos - est_slen))
+	{
+		est_slen = 0;
+		return;
+	}
+	for (n = est_slen;  n > 0;  n -= len)
+	{
+		len = ch_forw_span(&s);
+		if (len == 0)
+		{
+			est_slen -= n;
+			break;
+		}
+		if (len > n)
+			len = (int) n;
+		ch_skip(len);
+		(void) find_nl(s, len, 0, &count);
+		est_snl += count;
+	}
+}
+
+/*
+ * Return the line number associated with a given position if it 
+ * is known, like known_linenum.  Otherwise, return an estimate and 
+ * set *approxp to TRUE.  The estimate starts from the furthest line 
+ * number known before the position, so it gets better as more lines
+ * are counted.
+ * Return 0 if there is nothing to base an estimate on.
+ */
+public LINENUM est_linenum(POSITION pos, int *approxp)
+{
+	struct linenum_info *p;
+	LINENUM linenum;
+	LINENUM lines;
+	POSITION bytes;
+	POSITION bpos;
+	LINENUM bline;
+	double len;
+	double est;
+
+	*approxp = FALSE;
+	linenum = known_linenum(pos);
+	if (linenum != 0 || !linenums || pos == NULL_POSITION)
+		return (linenum);
+
+	/*
+	 * Find the furthest known line number before pos.
+	 */
+	bline = 1;
+	bpos = ch_zero();
+	for (p = anchor.next;  p != &anchor && p->pos < pos;  p = p->next)
+	{
+		bline = p->line;
+		bpos = p->pos;
+	}
+	if (nlnidx > 0 && lnidx[nlnidx - 1] > bpos && lnidx[nlnidx - 1] < pos)
+	{
+		bline = (nlnidx - 1) * LNUM_STEP + 1;
+		bpos = lnidx[nlnidx - 1];
+	}
+	if (cur_pos != NULL_POSITION && cur_pos > bpos && cur_pos < pos)
+	{
+		bline = cur_line;
+		bpos = cur_pos;
+	}
+
+	/*
+	 * Find the average length of the lines counted so far,
+	 * and of the lines near pos, and assume that the lines
+	 * in between are as long as the mean of the two.
+	 */
+	est_sample(pos);
+	lines = bline - 1;
+	bytes = bpos - ch_zero();
+	if (lines > 0 && est_snl > 0)
+		len = ((double) bytes / (double) lines + (double) est_slen / (double) est_snl) / 2.0;
+	else if (lines > 0)
+		len = (double) bytes / (double) lines;
+	else if (est_snl > 0)
+		len = (double) est_slen / (double) est_snl;
+	else
+		return (0);
+	est = (double) bline + (double) (pos - bpos) / len;
+	linenum = (LINENUM) est;
+	if (linenum <= bline)
+		linenum = bline + 1;
+	*approxp = TRUE;
+	return (linenum);
+}
+
+/*
+ * Convert an estimated line number to a short string
+ * marked as approximate, like "~1234" or "~1.2M".
+ */
+public void est_linenumtoa(LINENUM linenum, char *buf, int len)
+{
+	static char units[] = "KMGTPE";
+	double n = (double) linenum;
+	int i;
+
+	if (linenum < 10000)
+	{
+		SNPRINTF1(buf, len, "~%d", (int) linenum);
+		return;
+	}
+	n /= 1000.0;
+	for (i = 0;  n >= 999.5 && units[i+1] != '\0';  i++)
+		n /= 1000.0;
+	if (n < 9.95)
+		SNPRINTF2(buf, len, "~%.1f%c", n, units[i]);
+	else
+		SNPRINTF2(buf, len, "~%.0f%c", n, units[i]);
+}
+
 /*
  * Find the position of a given line number.
  * Return NULL_POSITION if we can't figure it out.
@@ -373,6 +1642,16 @@ public POSITION find_pos(LINENUM linenum)
 	struct linenum_info *p;
 	POSITION cpos;
 	LINENUM clinenum;
+	LINENUM i;
+	LINENUM n;
+	LINENUM cnt;
+	LINENUM pline;
+	POSITION ppos;
+	POSITION spos;
+	unsigned char *s;
+	unsigned char *t;
+	unsigned char *nl;
+	int len;
 
 	if (linenum <= 1)
 		/*
@@ -380,6 +1659,10 @@ public POSITION find_pos(LINENUM linenum)
 		 */
 		return (ch_zero());
 
+#if USE_PARCOUNT
+	if (pc.active)
+		pc_merge(FALSE);
+#endif
 	/*
 	 * Find the entry nearest to the line number we want.
 	 */
@@ -388,25 +1671,107 @@ public POSITION find_pos(LINENUM linenum)
 	if (p->line == linenum)
 		/* Found it exactly. */
 		return (p->pos);
+	/*
+	 * The line before it may be nearer in the line index.
+	 */
+	pline = p->prev->line;
+	ppos = p->prev->pos;
+	i = (linenum - 1) / LNUM_STEP;
+	if (i >= nlnidx)
+		i = nlnidx - 1;
+	if (i >= 0 && i * LNUM_STEP + 1 > pline)
+	{
+		pline = i * LNUM_STEP + 1;
+		ppos = lnidx[i];
+		if (pline == linenum)
+			return (ppos);
+	}
 
-	if (p == &anchor || linenum - p->prev->line < p->line - linenum)
+	if (p == &anchor || linenum - pline < p->line - linenum)
 	{
 		/*
 		 * Go forward.
 		 */
-		p = p->prev;
-		if (ch_seek(p->pos))
+		if (ch_seek(ppos))
 			return (NULL_POSITION);
-		for (clinenum = p->line, cpos = p->pos;  clinenum < linenum;  clinenum++)
+		for (clinenum = pline, cpos = ppos;  clinenum < linenum;  )
 		{
+#if USE_PARCOUNT
+			/*
+			 * If we have counted far and the line index is
+			 * up to date, the line index may be extended 
+			 * faster in parallel (or, if it is being extended 
+			 * in the background, we can wait for that).
+			 * Then start again from the nearest index entry.
+			 */
+			if (ppos != NULL_POSITION && 
+			    cpos - ppos >= (pc.active ? BG_NEAR_SIZE : PAR_MIN_SIZE) &&
+			    lnidx_next > clinenum && lnidx_next - clinenum <= LNUM_STEP)
+			{
+				ppos = NULL_POSITION;
+				if (lnidx_extend(NULL_POSITION, linenum, "Calculating line numbers") < 0)
+					return (NULL_POSITION);
+				i = (linenum - 1) / LNUM_STEP;
+				if (i >= nlnidx)
+					i = nlnidx - 1;
+				clinenum = i * LNUM_STEP + 1;
+				cpos = lnidx[i];
+				if (ch_seek(cpos))
+					return (NULL_POSITION);
+				continue;
+			}
+#endif
+			len = ch_forw_span(&s);
+			if (len == 0)
+			{
+				/*
+				 * End of file.  If the last line has 
+				 * no newline, it ends at end of file.
+				 */
+				if (ch_tell() == cpos)
+					return (NULL_POSITION);
+				cpos = ch_tell();
+				clinenum++;
+				continue;
+			}
+			spos = ch_tell();
+			/*
+			 * Find the newline ending the line before the one
+			 * we want, stopping at each line index entry.
+			 */
+			for (t = s;  clinenum < linenum;  )
+			{
+				n = linenum - clinenum;
+				if (lnidx_next > clinenum && lnidx_next - clinenum < n)
+					n = lnidx_next - clinenum;
+				nl = find_nl(t, len - (int) (t - s), n, &cnt);
+				if (nl == NULL)
+				{
+					/*
+					 * Not in this span; cpos is 
+					 * after its last newline, if any.
+					 */
+					if (cnt > 0)
+					{
+						clinenum += cnt;
+						nl = (unsigned char *) memrchr(t, '\n', (size_t) (len - (t - s)));
+						cpos = spos + (nl + 1 - s);
+					}
+					t = s + len;
+					break;
+				}
+				t = nl;
+				clinenum += n;
+				cpos = spos + (t - s);
+				if (clinenum == lnidx_next)
+					lnidx_add(clinenum, cpos);
+			}
+			ch_skip(t - s);
 			/*
 			 * Allow a signal to abort this loop.
 			 */
-			cpos = forw_raw_line(cpos, (char **)NULL, (int *)NULL);
 			if (ABORT_SIGS())
 				return (NULL_POSITION);
-			if (cpos == NULL_POSITION)
-				return (NULL_POSITION);
 		}
 	} else
 	{
@@ -438,8 +1803,10 @@ public POSITION find_pos(LINENUM linenum)
  * Return the line number of the "current" line.
  * The argument "where" tells which line is to be considered
  * the "current" line (e.g. TOP, BOTTOM, MIDDLE, etc).
+ * If the line number is not known yet, return an estimate
+ * and set *approxp to TRUE.
  */
-public LINENUM currline(int where)
+public LINENUM est_currline(int where, int *approxp)
 {
 	POSITION pos;
 	POSITION len;
@@ -451,8 +1818,8 @@ public LINENUM currline(int where)
 		pos = position(++where);
 	if (pos == NULL_POSITION)
 		pos = len;
-	linenum = find_linenum(pos);
-	if (pos == len)
+	linenum = est_linenum(pos, approxp);
+	if (pos == len && linenum > 0)
 		linenum--;
 	return (linenum);
 }
@@ -462,23 +1829,83 @@ public LINENUM currline(int where)
  */
 public void scan_eof(void)
 {
-	POSITION pos = 0;
-	LINENUM linenum = 0;
+	LINENUM linenum;
+	POSITION cpos;
+	unsigned char *s;
+	int len;
 
-	if (ch_seek(0))
+	/*
+	 * Start at the end of the part of the file 
+	 * which is already in the line index.
+	 */
+	if (nlnidx == 0)
 		return;
 	ierror("Determining length of file", NULL_PARG);
-	while (pos != NULL_POSITION)
+#if USE_PARCOUNT
+	if (lnidx_extend(NULL_POSITION, 0, "Determining length of file") < 0)
+		return;
+#endif
+	linenum = (nlnidx - 1) * LNUM_STEP + 1;
+	if (ch_seek(lnidx[nlnidx - 1]))
+		return;
+	while ((len = ch_forw_span(&s)) > 0)
 	{
-		/* For efficiency, only add one every 256 line numbers. */
-		if ((linenum++ % 256) == 0)
-			add_lnum(linenum, pos);
-		pos = forw_raw_line(pos, (char **)NULL, (int *)NULL);
+		count_lines(s, len, ch_tell(), &linenum, &cpos);
+		ch_skip(len);
 		if (ABORT_SIGS())
 			break;
 	}
 }
 
+/*
+ * Wait for input from the user.  Meanwhile, if line numbers which 
+ * could not be displayed are being calculated in the background,
+ * return TRUE as soon as they are known, so they can be displayed.
+ */
+public int linenum_wait(void)
+{
+#if USE_PARCOUNT
+	while (pc.active && bg_wanted != NULL_POSITION)
+	{
+		if (tty_ready(BG_POLL_MS))
+			return (FALSE);
+		pc_merge(FALSE);
+		if (!pc.active || pc.mpos >= bg_wanted)
+		{
+			bg_wanted = NULL_POSITION;
+			return (TRUE);
+		}
+	}
+#endif
+	return (FALSE);
+}
+
+/*
+ * A file has been opened.
+ * Load any line index saved for it.
+ */
+public void open_linenum(void)
+{
+#if USE_LNIDX_CACHE
+	lnidx_load();
+#endif
+}
+
+/*
+ * The current file is being closed.
+ * Stop counting its lines, and save its line index.
+ */
+public void close_linenum(void)
+{
+#if USE_PARCOUNT
+	pc_merge(FALSE);
+	pc_stop();
+#endif
+#if USE_LNIDX_CACHE
+	lnidx_save();
+#endif
+}
+
 /*
  * Return a line number adjusted for display
  * (handles the --no-number-headers option).
@@ -283,6 +283,10 @@ public int pipe_data(char *cmd, POSITION spos, POSITION epos)
 {
 	FILE *f;
 	int c;
+	int len;
+	POSITION left;
+	unsigned char *p;
+	unsigned char *nl;
 
 	/*
 	 * This is structured much like lsystem().
@@ -317,29 +321,39 @@ public int pipe_data(char *cmd, POSITION spos, POSITION epos)
 	LSIGNAL(SIGPIPE, SIG_IGN);
 #endif
 
+	/*
+	 * Give each span of the file up to epos to the pipe.
+	 */
 	c = EOI;
-	while (epos == NULL_POSITION || spos++ <= epos)
+	left = (epos == NULL_POSITION) ? -1 : 
+		(epos >= spos) ? epos - spos + 1 : 0;
+	while (left != 0 && (len = ch_forw_span(&p)) > 0)
 	{
-		/*
-		 * Read a character from the file and give it to the pipe.
-		 */
-		c = ch_forw_get();
-		if (c == EOI)
-			break;
-		if (putc(c, f) == EOF)
+		if (left > 0 && len > left)
+			len = (int) left;
+		if (fwrite(p, 1, len, f) != (size_t) len)
+		{
+			c = EOI;
 			break;
+		}
+		c = p[len-1];
+		ch_skip(len);
+		if (left > 0)
+			left -= len;
 	}
 
 	/*
 	 * Finish up the last line.
 	 */
-	while (c != '\n' && c != EOI ) 
+	while (c != '\n' && c != EOI && (len = ch_forw_span(&p)) > 0)
 	{
-		c = ch_forw_get();
-		if (c == EOI)
-			break;
-		if (putc(c, f) == EOF)
+		nl = (unsigned char *) memchr(p, '\n', len);
+		if (nl != NULL)
+			len = (int) (nl - p) + 1;
+		if (fwrite(p, 1, len, f) != (size_t) len)
 			break;
+		c = p[len-1];
+		ch_skip(len);
 	}
 
 	pclose(f);
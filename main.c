@@ -126,6 +126,7 @@ int main(int argc, char *argv[])
 	init_cmdhist();
 	init_option();
 	init_search();
+	init_linenum();
 
 	/*
 	 * If the name of the executable program is "more",
@@ -29,6 +29,8 @@
 
 extern int nbufs;
 extern int bufspace;
+extern int block_size;
+extern int total_bufspace;
 extern int pr_type;
 extern int plusoption;
 extern int swindow;
@@ -468,6 +470,56 @@ public void opt_b(int type, char *s)
 	}
 }
 
+/*
+ * Handler for the --block-size option.
+ */
+	/*ARGSUSED*/
+public void opt_block_size(int type, char *s)
+{
+	PARG parg;
+
+	switch (type)
+	{
+	case INIT:
+	case TOGGLE:
+		if (block_size < 0 || block_size > MAX_BLOCK_SIZE)
+		{
+			parg.p_int = MAX_BLOCK_SIZE;
+			error("Block size must be between 0 and %d", &parg);
+			block_size = 0;
+		}
+		break;
+	case QUERY:
+		break;
+	}
+}
+
+/*
+ * Handler for the --total-buffers option.
+ */
+	/*ARGSUSED*/
+public void opt_total_buffers(int type, char *s)
+{
+	PARG parg;
+
+	switch (type)
+	{
+	case INIT:
+	case TOGGLE:
+		if (total_bufspace >= 0 && total_bufspace < ch_minbufspace())
+		{
+			parg.p_int = ch_minbufspace();
+			error("Total buffer space must be at least %dK", &parg);
+			total_bufspace = -1;
+		}
+		if (type == TOGGLE)
+			ch_trimbufspace();
+		break;
+	case QUERY:
+		break;
+	}
+}
+
 /*
  * Handler for the -i option.
  */
@@ -76,6 +76,11 @@ public int def_search_type;     /* */
 public int exit_F_on_close;     /* Exit F command when input closes */
 public int modelines;           /* Lines to read looking for modelines */
 public int show_preproc_error;  /* Display msg when preproc exits with error */
+public int block_size;          /* Size of file buffers (K); 0 = adaptive */
+public int use_spool;           /* Spool data from pipes to a temp file */
+public int total_bufspace;      /* Max buffer space for all files (K) */
+public int cold_read;           /* Min size of file read in cold mode (M) */
+public int match_index;         /* Index all matches of the search pattern */
 public char intr_char = CONTROL('X'); /* Char to interrupt reads */
 #if HILITE_SEARCH
 public int hilite_search;       /* Highlight matched search patterns? */
@@ -164,6 +169,11 @@ static struct optname no_vbell_optname = { "no-vbell", NULL };
 static struct optname intr_optname = { "intr", NULL };
 static struct optname wordwrap_optname = { "wordwrap", NULL };
 static struct optname show_preproc_error_optname = { "show-preproc-errors", NULL };
+static struct optname block_size_optname = { "block-size", NULL };
+static struct optname use_spool_optname = { "spool", NULL };
+static struct optname total_bufspace_optname = { "total-buffers", NULL };
+static struct optname cold_read_optname = { "cold-read", NULL };
+static struct optname match_index_optname = { "match-index", NULL };
 #if LESSTEST
 static struct optname ttyin_name_optname = { "tty",              NULL };
 #endif /*LESSTEST*/
@@ -678,6 +688,46 @@ static struct loption option[] =
 			NULL
 		}
 	},
+	{ OLETTER_NONE, &block_size_optname,
+		NUMBER, 0, &block_size, opt_block_size,
+		{
+			"Block size of file buffers (K): ",
+			"Block size of file buffers: %dK (0 = adaptive)",
+			NULL
+		}
+	},
+	{ OLETTER_NONE, &use_spool_optname,
+		BOOL, OPT_OFF, &use_spool, NULL,
+		{
+			"Don't spool input pipes",
+			"Spool input pipes to a temporary file",
+			NULL
+		}
+	},
+	{ OLETTER_NONE, &total_bufspace_optname,
+		NUMBER, -1, &total_bufspace, opt_total_buffers,
+		{
+			"Max buffer space for all files (K): ",
+			"Max buffer space for all files: %dK",
+			NULL
+		}
+	},
+	{ OLETTER_NONE, &cold_read_optname,
+		NUMBER, 1024, &cold_read, NULL,
+		{
+			"Min size of file to read in cold mode (M): ",
+			"Min size of file to read in cold mode: %dM",
+			NULL
+		}
+	},
+	{ OLETTER_NONE, &match_index_optname,
+		BOOL, OPT_OFF, &match_index, NULL,
+		{
+			"Don't index search matches",
+			"Index search matches in the background",
+			NULL
+		}
+	},
 #if LESSTEST
 	{ OLETTER_NONE, &ttyin_name_optname,
 		STRING|NO_TOGGLE, 0, NULL, opt_ttyin_name,
@@ -49,6 +49,18 @@ static int use_poll = TRUE;
 #if USE_POLL
 #include <poll.h>
 #endif
+#if HAVE_READV && HAVE_SYS_UIO_H
+#define USE_READV 1
+#include <sys/uio.h>
+#else
+#define USE_READV 0
+#endif
+#if HAVE_INOTIFY_INIT1 && HAVE_SYS_INOTIFY_H && USE_POLL
+#define USE_INOTIFY 1
+#include <sys/inotify.h>
+#else
+#define USE_INOTIFY 0
+#endif
 
 /*
  * BSD setjmp() saves (and longjmp() restores) the signal mask.
@@ -70,6 +82,11 @@ public int waiting_for_data;
 public int consecutive_nulls = 0;
 
 static jmp_buf read_label;
+#if USE_INOTIFY
+static int inotify_fd = -1;
+static char *watch_name = NULL;
+static int watch_dir;
+#endif
 
 extern int sigs;
 extern int ignore_eoi;
@@ -139,11 +156,11 @@ public int supports_ctrl_x(void)
 }
 
 /*
- * Like read() system call, but is deliberately interruptible.
- * A call to intread() from a signal handler will interrupt
- * any pending iread().
+ * Common code for iread and ireadv.
+ * If iov is not NULL, read into the iovcnt buffers it describes;
+ * otherwise read into buf.
  */
-public int iread(int fd, unsigned char *buf, unsigned int len)
+static int iread_common(int fd, unsigned char *buf, unsigned int len, struct iovec *iov, int iovcnt)
 {
 	int n;
 
@@ -231,6 +248,11 @@ start:
 		return (READ_INTR);
 	}
 #endif
+#endif
+#if USE_READV
+	if (iov != NULL)
+		n = readv(fd, iov, iovcnt);
+	else
 #endif
 	n = read(fd, buf, len);
 	reading = 0;
@@ -275,6 +297,29 @@ start:
 	return (n);
 }
 
+/*
+ * Like read() system call, but is deliberately interruptible.
+ * A call to intread() from a signal handler will interrupt
+ * any pending iread().
+ */
+public int iread(int fd, unsigned char *buf, unsigned int len)
+{
+	return (iread_common(fd, buf, len, NULL, 0));
+}
+
+/*
+ * Like readv() system call, but interruptible like iread().
+ * Return READ_ERR if readv() is not available.
+ */
+public int ireadv(int fd, struct iovec *iov, int iovcnt)
+{
+#if USE_READV
+	return (iread_common(fd, NULL, 0, iov, iovcnt));
+#else
+	return (READ_ERR);
+#endif
+}
+
 /*
  * Interrupt a pending iread().
  */
@@ -415,6 +460,21 @@ char * strchr(char *s, char c)
 }
 #endif
 
+#if !HAVE_MEMRCHR
+/*
+ * memrchr is used by back_raw_line.
+ */
+void * memrchr(const void *s, int c, size_t n)
+{
+	const unsigned char *p = (const unsigned char *) s + n;
+
+	while (p > (const unsigned char *) s)
+		if (*--p == (unsigned char) c)
+			return ((void *) p);
+	return (NULL);
+}
+#endif
+
 #if !HAVE_MEMCPY
 void * memcpy(void *dst, void *src, int len)
 {
@@ -451,6 +511,132 @@ int isatty(int f)
 	
 #endif
 
+/*
+ * Start watching a file which is being followed,
+ * so that follow_wait can wait for it to change.
+ * If follow_name is set, also watch its directory, so that 
+ * a new file created or renamed to the same name is noticed.
+ * Return TRUE if the file can be watched.
+ */
+public int follow_watch(constant char *filename, int follow_name)
+{
+#if USE_INOTIFY
+	char *dir;
+	char *p;
+	int ok;
+
+	if (inotify_fd >= 0 && strcmp(filename, watch_name) == 0 &&
+	    watch_dir == follow_name)
+		return (TRUE);
+	follow_unwatch();
+	inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (inotify_fd < 0)
+		return (FALSE);
+	ok = inotify_add_watch(inotify_fd, filename,
+		IN_MODIFY|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF) >= 0;
+	if (ok && follow_name)
+	{
+		dir = save(filename);
+		p = strrchr(dir, '/');
+		if (p == NULL)
+			strcpy(dir, ".");
+		else if (p == dir)
+			p[1] = '\0';
+		else
+			*p = '\0';
+		ok = inotify_add_watch(inotify_fd, dir,
+			IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO) >= 0;
+		free(dir);
+	}
+	if (!ok)
+	{
+		follow_unwatch();
+		return (FALSE);
+	}
+	watch_name = save(filename);
+	watch_dir = follow_name;
+	return (TRUE);
+#else
+	return (FALSE);
+#endif
+}
+
+/*
+ * Stop watching the file being followed.
+ */
+public void follow_unwatch(void)
+{
+#if USE_INOTIFY
+	if (inotify_fd >= 0)
+		close(inotify_fd);
+	inotify_fd = -1;
+	if (watch_name != NULL)
+		free(watch_name);
+	watch_name = NULL;
+#endif
+}
+
+/*
+ * Wait until the watched file may have changed, a key is typed,
+ * a signal arrives or ms milliseconds have passed.
+ * Without a watched file, just sleep.
+ */
+public void follow_wait(int ms)
+{
+#if USE_INOTIFY
+	if (inotify_fd >= 0)
+	{
+		struct pollfd poller[2] = { { inotify_fd, POLLIN, 0 }, { tty, POLLIN, 0 } };
+		int npoll = 2;
+		char buf[4096];
+
+#if LESSTEST
+		if (ttyin_name != NULL) /* Input is not from a real tty. */
+			npoll = 1;
+#endif /*LESSTEST*/
+		if (!use_poll)
+			npoll = 1;
+		if (poll(poller, npoll, ms) > 0 && (poller[0].revents & POLLIN))
+		{
+			/*
+			 * Discard the events; the caller looks at
+			 * the file itself to see what has changed.
+			 */
+			while (read(inotify_fd, buf, sizeof(buf)) > 0)
+				continue;
+		}
+		return;
+	}
+#endif
+	sleep_ms(ms);
+}
+
+/*
+ * Wait up to ms milliseconds for a key to be typed.
+ * Return TRUE if one has been (or if we can't tell).
+ */
+public int tty_ready(int ms)
+{
+#if LESSTEST
+	if (ttyin_name != NULL) /* Input is not from a real tty. */
+	{
+		/*
+		 * Let nothing be interrupted by the next char,
+		 * so a session sees the same screens every time.
+		 */
+		sleep_ms(ms);
+		return (FALSE);
+	}
+#endif /*LESSTEST*/
+#if USE_POLL
+	struct pollfd poller = { tty, POLLIN, 0 };
+
+	if (use_poll)
+		return (poll(&poller, 1, ms) != 0);
+#endif
+	return (TRUE);
+}
+
 public void sleep_ms(int ms)
 {
 #if MSDOS_COMPILER==WIN32C
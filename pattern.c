@@ -12,6 +12,32 @@
  */
 
 #include "less.h"
+#include "charset.h"
+
+/*
+ * A literal string (SRCH_NO_REGEX) is searched for by looking for 
+ * its first and last bytes 16 positions at a time where the compiler 
+ * lets us use SSE2, and comparing the rest only where both are found.
+ * Otherwise memchr finds the places where the first byte is.
+ */
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SSE2 1
+#include <emmintrin.h>
+#else
+#define USE_SSE2 0
+#endif
+
+#define FOLD_BUF_SIZE   256     /* Fold a longer pattern in allocated memory */
+
+/*
+ * pattern_literal understands the syntax of these regex libraries.
+ */
+#if HAVE_GNU_REGEX || HAVE_PCRE || HAVE_PCRE2 || (HAVE_POSIX_REGCOMP && defined(REG_EXTENDED))
+#define USE_REQ_LITERAL 1
+#else
+#define USE_REQ_LITERAL 0
+#endif
+#define ASCII_IS_ALNUM(c)  (ASCII_IS_UPPER(c) || ASCII_IS_LOWER(c) || ((c) >= '0' && (c) <= '9'))
 
 extern int caseless;
 extern int is_caseless;
@@ -80,10 +106,11 @@ static int compile_pattern2(char *pattern, int search_type, PATTERN_TYPE *comp_p
 	int errcode;
 	PCRE2_SIZE erroffset;
 	PARG parg;
-	pcre2_code *comp = pcre2_compile((PCRE2_SPTR)pattern, strlen(pattern),
+	struct pcre2_pattern *comp;
+	pcre2_code *code = pcre2_compile((PCRE2_SPTR)pattern, strlen(pattern),
 			(is_caseless ? PCRE2_CASELESS : 0),
 			&errcode, &erroffset, NULL);
-	if (comp == NULL)
+	if (code == NULL)
 	{
 		if (show_error)
 		{
@@ -94,6 +121,28 @@ static int compile_pattern2(char *pattern, int search_type, PATTERN_TYPE *comp_p
 		}
 		return (-1);
 	}
+	comp = (struct pcre2_pattern *) ecalloc(1, sizeof(struct pcre2_pattern));
+	comp->code = code;
+	comp->md = pcre2_match_data_create(NUM_SEARCH_COLORS+1, NULL);
+	if (comp->md == NULL)
+	{
+		pcre2_code_free(code);
+		free(comp);
+		if (show_error)
+			error("Cannot allocate memory", NULL_PARG);
+		return (-1);
+	}
+	/*
+	 * Use the JIT compiler if the library has one;
+	 * otherwise pcre2_match interprets the pattern.
+	 */
+	comp->jit = (pcre2_jit_compile(code, PCRE2_JIT_COMPLETE) == 0);
+	if (*comp_pattern != NULL)
+	{
+		pcre2_match_data_free((*comp_pattern)->md);
+		pcre2_code_free((*comp_pattern)->code);
+		free(*comp_pattern);
+	}
 	*comp_pattern = comp;
 #endif
 #if HAVE_RE_COMP
@@ -160,6 +209,308 @@ public int compile_pattern(char *pattern, int search_type, int show_error, PATTE
 	return (result);
 }
 
+#if USE_REQ_LITERAL
+/*
+ * State of pattern_literal: the run of literal chars it is looking at,
+ * and the longest one found so far.
+ */
+struct litstate
+{
+	char *run;
+	int rlen;
+	int clast;              /* Where the last char of run starts, or -1 */
+	int closed;             /* Nothing more can be added to run */
+	char *best;
+	int blen;
+	int icase;
+};
+
+/*
+ * End the current run, remembering it if it is the longest yet.
+ */
+static void lit_end(struct litstate *ls)
+{
+	if (ls->rlen > ls->blen)
+	{
+		memcpy(ls->best, ls->run, (size_t) ls->rlen);
+		ls->blen = ls->rlen;
+	}
+	ls->rlen = 0;
+	ls->clast = -1;
+	ls->closed = FALSE;
+}
+
+/*
+ * Add a char to the current run.
+ */
+static void lit_add(struct litstate *ls, char *s, int len)
+{
+	if (ls->closed)
+		lit_end(ls);
+	ls->clast = ls->rlen;
+	while (len-- > 0)
+	{
+		ls->run[ls->rlen++] = (ls->icase && ASCII_IS_UPPER(*s)) ? ASCII_TO_LOWER(*s) : *s;
+		s++;
+	}
+}
+
+/*
+ * Skip a bracket expression.
+ * Return a pointer to the char after it, or NULL if we don't understand it.
+ */
+static char * lit_skip_bracket(char *p)
+{
+	char c;
+
+	p++;
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	for (;;)
+	{
+		/*
+		 * A backslash is an escape in some regex libraries
+		 * but not in others, so we can't tell where it ends.
+		 */
+		if (*p == '\0' || *p == '\\')
+			return (NULL);
+		if (*p == ']')
+			return (p+1);
+		if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '='))
+		{
+			/* [:class:], [.coll.] or [=equiv=] */
+			c = p[1];
+			for (p += 2;  *p != '\0' && !(p[0] == c && p[1] == ']');  p++)
+				continue;
+			if (*p == '\0')
+				return (NULL);
+			p += 2;
+		} else
+			p++;
+	}
+}
+
+/*
+ * Skip a parenthesized group.
+ * Return a pointer to the char after it, or NULL if it isn't closed.
+ */
+static char * lit_skip_group(char *p)
+{
+	int depth = 0;
+
+	while (*p != '\0')
+	{
+		if (*p == '\\')
+		{
+			if (p[1] == '\0')
+				return (NULL);
+			p += 2;
+			continue;
+		}
+		if (*p == '[')
+		{
+			if ((p = lit_skip_bracket(p)) == NULL)
+				return (NULL);
+			continue;
+		}
+		if (*p == '(')
+			depth++;
+		else if (*p == ')' && --depth == 0)
+			return (p+1);
+		p++;
+	}
+	return (NULL);
+}
+
+/*
+ * Skip a {...}, <...> or '...' which may follow an escape,
+ * like \p{L}, \k<name> or \d{3}.
+ * Return NULL if it isn't closed.
+ */
+static char * lit_skip_arg(char *p, int angle)
+{
+	char *e;
+
+	if (*p == '{')
+		e = strchr(p, '}');
+	else if (angle && *p == '<')
+		e = strchr(p, '>');
+	else if (angle && *p == '\'')
+		e = strchr(p+1, '\'');
+	else
+		return (p);
+	return ((e == NULL) ? NULL : e+1);
+}
+#endif
+
+/*
+ * Find a string which must be in any line matched by a regular 
+ * expression, so lines without it can be passed over without 
+ * running the regex.  We look for the longest run of literal 
+ * chars which is not inside a group and is not made optional by 
+ * a following "*", "?" or "{".  A pattern with a "|" outside a group, 
+ * or which we don't understand, has none.
+ * Return the string in allocated memory and set *lenp to its length, 
+ * or return NULL if there is none.
+ * If *icasep is set, the string is in lower case and the case of 
+ * ASCII letters in the line should be ignored when looking for it.
+ */
+public char * pattern_literal(char *pattern, int search_type, int *lenp, int *icasep)
+{
+#if USE_REQ_LITERAL
+	struct litstate ls;
+	char *cvt_pattern;
+	char *p;
+	int fail = FALSE;
+	int len;
+	int c;
+
+	if (search_type & SRCH_NO_REGEX)
+		return (NULL);
+	/*
+	 * (?...) may change what the rest of the pattern means,
+	 * and \Q quotes metacharacters, in PCRE.
+	 */
+	if (strstr(pattern, "(?") != NULL || strstr(pattern, "(*") != NULL ||
+	    strstr(pattern, "\\Q") != NULL)
+		return (NULL);
+	/* Convert the pattern as compile_pattern does. */
+	if (caseless != OPT_ONPLUS || re_handles_caseless)
+		cvt_pattern = pattern;
+	else
+	{
+		cvt_pattern = (char*) ecalloc(1, cvt_length(strlen(pattern), CVT_TO_LC));
+		cvt_text(cvt_pattern, pattern, (int *)NULL, (int *)NULL, CVT_TO_LC);
+	}
+	/* A caseless regex library leaves the case of the line alone. */
+	ls.icase = is_caseless && re_handles_caseless;
+	ls.run = (char *) ecalloc(strlen(cvt_pattern)+1, sizeof(char));
+	ls.best = (char *) ecalloc(strlen(cvt_pattern)+1, sizeof(char));
+	ls.rlen = ls.blen = 0;
+	ls.clast = -1;
+	ls.closed = FALSE;
+
+	for (p = cvt_pattern;  *p != '\0' && !fail;  )
+	{
+		c = (unsigned char) *p;
+		switch (c)
+		{
+		case '|':
+		case ')':
+			fail = TRUE;
+			break;
+		case '(':
+		case '[':
+			lit_end(&ls);
+			p = (c == '(') ? lit_skip_group(p) : lit_skip_bracket(p);
+			fail = (p == NULL);
+			break;
+		case '.':
+		case '^':
+		case '$':
+			lit_end(&ls);
+			p++;
+			break;
+		case '+':
+			/* The last char is there, but may be followed by more. */
+			ls.closed = TRUE;
+			p++;
+			break;
+		case '*':
+		case '?':
+		case '{':
+			/* The last char may not be there. */
+			if (ls.clast >= 0)
+				ls.rlen = ls.clast;
+			lit_end(&ls);
+			if (c == '{')
+				fail = ((p = lit_skip_arg(p, FALSE)) == NULL);
+			else
+				p++;
+			break;
+		case '\\':
+			c = (unsigned char) p[1];
+			if (c == '\0' || !IS_ASCII_OCTET(c))
+			{
+				fail = TRUE;
+				break;
+			}
+			p += 2;
+			if (!ASCII_IS_ALNUM(c) && c != '<' && c != '>' && c != '`' && c != '\'')
+			{
+				/* An escaped metacharacter. */
+				lit_add(&ls, p-1, 1);
+				break;
+			}
+			/*
+			 * Something like \w or \b, or \x41 or \1.
+			 * Skip anything it may take as an argument.
+			 */
+			lit_end(&ls);
+			if (c == 'c' || ((c == 'p' || c == 'P') && *p != '{'))
+			{
+				if (*p != '\0')
+					p++;
+			} else if (c == 'x' || (c >= '0' && c <= '9') || c == 'g')
+			{
+				if (c == 'g' && *p == '-')
+					p++;
+				while (ASCII_IS_ALNUM(*p))
+					p++;
+			}
+			fail = ((p = lit_skip_arg(p, c == 'g' || c == 'k')) == NULL);
+			break;
+		default:
+			if (utf_mode)
+			{
+				len = utf_len(c);
+				if (!is_utf8_well_formed(p, len))
+				{
+					fail = TRUE;
+					break;
+				}
+			} else
+			{
+				/*
+				 * The regex library may see several non-ASCII
+				 * bytes as one char, so treat them as one.
+				 */
+				for (len = 1;  !IS_ASCII_OCTET(c) && !IS_ASCII_OCTET(p[len]);  len++)
+					continue;
+			}
+			/*
+			 * If the regex library ignores case, only ASCII letters
+			 * will do, except those which the case of some other 
+			 * letter folds to in Unicode (like the Kelvin sign to k).
+			 */
+			if (ls.icase && (!IS_ASCII_OCTET(c) || 
+			    (utf_mode && strchr("kKsSiI", c) != NULL)))
+				lit_end(&ls);
+			else
+				lit_add(&ls, p, len);
+			p += len;
+			break;
+		}
+	}
+	lit_end(&ls);
+	free(ls.run);
+	if (cvt_pattern != pattern)
+		free(cvt_pattern);
+	if (fail || ls.blen == 0)
+	{
+		free(ls.best);
+		return (NULL);
+	}
+	*lenp = ls.blen;
+	*icasep = ls.icase;
+	return (ls.best);
+#else
+	return (NULL);
+#endif
+}
+
 /*
  * Forget that we have a compiled pattern.
  */
@@ -188,7 +539,11 @@ public void uncompile_pattern(PATTERN_TYPE *pattern)
 #endif
 #if HAVE_PCRE2
 	if (*pattern != NULL)
-		pcre2_code_free(*pattern);
+	{
+		pcre2_match_data_free((*pattern)->md);
+		pcre2_code_free((*pattern)->code);
+		free(*pattern);
+	}
 	*pattern = NULL;
 #endif
 #if HAVE_RE_COMP
@@ -254,38 +609,130 @@ public int is_null_pattern(PATTERN_TYPE pattern)
 	return (pattern == NULL);
 #endif
 }
+
+/*
+ * Do the m bytes at s match the string pat?
+ * If icase is set, pat is in lower case and upper case ASCII letters 
+ * at s match it too.
+ */
+static int lit_equal(char *pat, int m, int icase, char *s)
+{
+	int i;
+
+	if (!icase)
+		return (memcmp(s, pat, (size_t) m) == 0);
+	for (i = 0;  i < m;  i++)
+		if ((ASCII_IS_UPPER(s[i]) ? ASCII_TO_LOWER(s[i]) : s[i]) != pat[i])
+			return (0);
+	return (1);
+}
+
+/*
+ * Return a pointer to the first occurrence of the string pat
+ * (of length m, at least 1) in the n bytes at s, or NULL.
+ * If icase is set, ignore the case of ASCII letters; pat must be
+ * in lower case.
+ */
+public char * find_literal(char *pat, int m, int icase, char *s, int n)
+{
+	char *last = s + n - m;  /* Last place it can start */
+	char *p = s;
+#if USE_SSE2
+	__m128i first;
+	__m128i lastc;
+	__m128i fold;
+	unsigned int mask;
+	int i;
+#endif
+
+	if (m > n)
+		return (NULL);
+#if USE_SSE2
+	/*
+	 * Setting the 0x20 bit of every byte makes upper case ASCII 
+	 * letters lower case; other bytes may then match which 
+	 * shouldn't, but lit_equal finds that out.
+	 */
+	fold = _mm_set1_epi8(icase ? 0x20 : 0);
+	first = _mm_set1_epi8(pat[0] | (icase ? 0x20 : 0));
+	lastc = _mm_set1_epi8(pat[m-1] | (icase ? 0x20 : 0));
+	for ( ;  last - p >= 15;  p += 16)
+	{
+		mask = (unsigned int) _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(_mm_or_si128(_mm_loadu_si128((__m128i *) p), fold), first),
+			_mm_cmpeq_epi8(_mm_or_si128(_mm_loadu_si128((__m128i *) (p + m - 1)), fold), lastc)));
+		for ( ;  mask != 0;  mask &= mask - 1)
+		{
+			i = __builtin_ctz(mask);
+			if (lit_equal(pat, m, icase, p + i))
+				return (p + i);
+		}
+	}
+#endif
+	if (icase)
+	{
+		for ( ;  p <= last;  p++)
+			if (lit_equal(pat, m, icase, p))
+				return (p);
+		return (NULL);
+	}
+	for ( ;  p <= last;  p++)
+	{
+		p = (char *) memchr(p, pat[0], (size_t) (last - p + 1));
+		if (p == NULL)
+			break;
+		if (memcmp(p + 1, pat + 1, (size_t) (m - 1)) == 0)
+			return (p);
+	}
+	return (NULL);
+}
+
 /*
  * Simple pattern matching function.
  * It supports no metacharacters like *, etc.
  */
 static int match(char *pattern, int pattern_len, char *buf, int buf_len, char ***sp, char ***ep, int nsubs)
 {
-	char *pp, *lp;
-	char *pattern_end = pattern + pattern_len;
-	char *buf_end = buf + buf_len;
+	char fold_buf[FOLD_BUF_SIZE];
+	char *fold = NULL;
+	char *found;
+	int i;
 
-	for ( ;  buf < buf_end;  buf++)
+	if (pattern_len == 0)
 	{
-		for (pp = pattern, lp = buf;  ;  pp++, lp++)
-		{
-			char cp = *pp;
-			char cl = *lp;
-			if (caseless == OPT_ONPLUS && ASCII_IS_UPPER(cp))
-				cp = ASCII_TO_LOWER(cp);
-			if (cp != cl)
-				break;
-			if (pp == pattern_end || lp == buf_end)
-				break;
-		}
-		if (pp == pattern_end)
+		/* An empty pattern matches at the start of any non-empty line. */
+		found = (buf_len > 0) ? buf : NULL;
+	} else
+	{
+		/*
+		 * With -I, the line has been converted to lower case,
+		 * so convert the pattern too.
+		 */
+		if (caseless == OPT_ONPLUS)
 		{
-			*(*sp)++ = buf;
-			*(*ep)++ = lp;
-			return (1);
+			for (i = 0;  i < pattern_len && !ASCII_IS_UPPER(pattern[i]);  i++)
+				continue;
+			if (i < pattern_len)
+			{
+				fold = (pattern_len <= FOLD_BUF_SIZE) ? fold_buf :
+					(char *) ecalloc(pattern_len, sizeof(char));
+				for (i = 0;  i < pattern_len;  i++)
+					fold[i] = ASCII_IS_UPPER(pattern[i]) ?
+						ASCII_TO_LOWER(pattern[i]) : pattern[i];
+			}
 		}
+		found = find_literal((fold != NULL) ? fold : pattern, pattern_len, FALSE, buf, buf_len);
+		if (fold != NULL && fold != fold_buf)
+			free(fold);
 	}
-	**sp = **ep = NULL;
-	return (0);
+	if (found == NULL)
+	{
+		**sp = **ep = NULL;
+		return (0);
+	}
+	*(*sp)++ = found;
+	*(*ep)++ = found + pattern_len;
+	return (1);
 }
 
 /*
@@ -386,9 +833,20 @@ static int match_pattern1(PATTERN_TYPE pattern, char *tpattern, char *line, int
 #if HAVE_PCRE2
 	{
 		int flags = (notbol) ? PCRE2_NOTBOL : 0;
-		pcre2_match_data *md = pcre2_match_data_create(nsp-1, NULL);
-		int mcount = pcre2_match(pattern, (PCRE2_SPTR)line, line_len,
-			0, flags, md, NULL);
+		pcre2_match_data *md = pattern->md;
+		int mcount = PCRE2_ERROR_NOMATCH;
+		if (pattern->jit)
+			mcount = pcre2_jit_match(pattern->code, (PCRE2_SPTR)line, line_len,
+				0, flags, md, NULL);
+		/*
+		 * The JIT code runs out of stack on some long lines; 
+		 * the interpreter has more room, so let it try.
+		 * (pcre2_match would run the JIT code again without PCRE2_NO_JIT.)
+		 */
+		if (!pattern->jit || mcount == PCRE2_ERROR_JIT_STACKLIMIT ||
+		    mcount == PCRE2_ERROR_NOMEMORY)
+			mcount = pcre2_match(pattern->code, (PCRE2_SPTR)line, line_len,
+				0, flags | PCRE2_NO_JIT, md, NULL);
 		matched = (mcount > 0);
 		if (matched)
 		{
@@ -409,7 +867,6 @@ static int match_pattern1(PATTERN_TYPE pattern, char *tpattern, char *line, int
 				}
 			}
 		}
-		pcre2_match_data_free(md);
 	}
 #endif
 #if HAVE_RE_COMP
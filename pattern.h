@@ -39,7 +39,13 @@
 #if HAVE_PCRE2
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
-#define PATTERN_TYPE             pcre2_code *
+struct pcre2_pattern
+{
+	pcre2_code *code;
+	pcre2_match_data *md;   /* Used by every match, so it isn't made each time */
+	int jit;                /* code has been compiled by the JIT compiler */
+};
+#define PATTERN_TYPE             struct pcre2_pattern *
 #define SET_NULL_PATTERN(name)   name = NULL
 #define re_handles_caseless      TRUE
 #endif
@@ -45,7 +45,7 @@ static constant char s_proto[] =
 static constant char m_proto[] =
   "?n?f%f .?m(%T %i of %m) ..?e(END) ?x- Next\\: %x.:?pB%pB\\%:byte %bB?s/%s...%t";
 static constant char M_proto[] =
-  "?f%f .?n?m(%T %i of %m) ..?ltlines %lt-%lb?L/%L. :byte %bB?s/%s. .?e(END) ?x- Next\\: %x.:?pB%pB\\%..%t";
+  "?f%f .?n?m(%T %i of %m) ..?ltlines %lt-%lb?L/%L. :byte %bB?s/%s. .?Hmatch %hj of %H .?e(END) ?x- Next\\: %x.:?pB%pB\\%..%t";
 static constant char e_proto[] =
   "?f%f .?m(%T %i of %m) .?ltlines %lt-%lb?L/%L. .byte %bB?s/%s. ?e(END) :?pB%pB\\%..%t";
 static constant char h_proto[] =
@@ -125,6 +125,22 @@ static void ap_linenum(LINENUM linenum)
 	ap_str(buf);
 }
 
+/*
+ * Append a line number, which may be an estimate, to the end of the message.
+ */
+static void ap_est_linenum(LINENUM linenum, int approx)
+{
+	char buf[INT_STRLEN_BOUND(linenum) + 2];
+
+	if (!approx)
+	{
+		ap_linenum(linenum);
+		return;
+	}
+	est_linenumtoa(linenum, buf, (int) sizeof(buf));
+	ap_str(buf);
+}
+
 /*
  * Append an integer to the end of the message.
  */
@@ -168,6 +184,8 @@ static POSITION curr_byte(int where)
 static int cond(char c, int where)
 {
 	POSITION len;
+	int approx;
+	int done;
 
 	switch (c)
 	{
@@ -182,11 +200,15 @@ static int cond(char c, int where)
 	case 'f': /* Filename known? */
 	case 'g':
 		return (strcmp(get_filename(curr_ifile), "-") != 0);
+	case 'h': /* Number of search matches up to line known? */
+		return (match_index_rank(curr_byte(where)) >= 0);
+	case 'H': /* Search matches being counted? */
+		return (match_index_count(&done) >= 0);
 	case 'l': /* Line number known? */
 	case 'd': /* Same as l */
 		if (!linenums)
 			return 0;
-		return (currline(where) != 0);
+		return (est_currline(where, &approx) != 0);
 	case 'L': /* Final line number known? */
 	case 'D': /* Final page number known? */
 		return (linenums && ch_length() != NULL_POSITION);
@@ -206,9 +228,9 @@ static int cond(char c, int where)
 		return (curr_byte(where) != NULL_POSITION && 
 				ch_length() > 0);
 	case 'P': /* Percent into file (lines) known? */
-		return (currline(where) != 0 &&
+		return (est_currline(where, &approx) != 0 &&
 				(len = ch_length()) > 0 &&
-				find_linenum(len) != 0);
+				est_linenum(len, &approx) != 0);
 	case 's': /* Size of file known? */
 	case 'B':
 		return (ch_length() != NULL_POSITION);
@@ -236,6 +258,9 @@ static void protochar(int c, int where, int iseditproto)
 	int n;
 	LINENUM linenum;
 	LINENUM last_linenum;
+	int approx;
+	int last_approx;
+	int done;
 	IFILE h;
 	char *s;
 
@@ -255,9 +280,9 @@ static void protochar(int c, int where, int iseditproto)
 		ap_int(hshift);
 		break;
 	case 'd': /* Current page number */
-		linenum = currline(where);
+		linenum = est_currline(where, &approx);
 		if (linenum > 0 && sc_height > header_lines + 1)
-			ap_linenum(PAGE_NUM(linenum));
+			ap_est_linenum(PAGE_NUM(linenum), approx);
 		else
 			ap_quest();
 		break;
@@ -271,7 +296,7 @@ static void protochar(int c, int where, int iseditproto)
 			ap_linenum(0);
 		else
 		{
-			linenum = find_linenum(len - 1);
+			linenum = known_linenum(len - 1);
 			if (linenum <= 0)
 				ap_quest();
 			else 
@@ -294,6 +319,24 @@ static void protochar(int c, int where, int iseditproto)
 		ap_str(s);
 		free(s);
 		break;
+	case 'h': /* Number of search matches up to line */
+		linenum = match_index_rank(curr_byte(where));
+		if (linenum >= 0)
+			ap_linenum(linenum);
+		else
+			ap_quest();
+		break;
+	case 'H': /* Number of search matches */
+		linenum = match_index_count(&done);
+		if (linenum < 0)
+			ap_quest();
+		else
+		{
+			ap_linenum(linenum);
+			if (!done)
+				ap_char('+');
+		}
+		break;
 	case 'i': /* Index into list of files */
 #if TAGS
 		if (ntags())
@@ -303,19 +346,19 @@ static void protochar(int c, int where, int iseditproto)
 			ap_int(get_index(curr_ifile));
 		break;
 	case 'l': /* Current line number */
-		linenum = currline(where);
+		linenum = est_currline(where, &approx);
 		if (linenum != 0)
-			ap_linenum(vlinenum(linenum));
+			ap_est_linenum(vlinenum(linenum), approx);
 		else
 			ap_quest();
 		break;
 	case 'L': /* Final line number */
 		len = ch_length();
 		if (len == NULL_POSITION || len == ch_zero() ||
-		    (linenum = find_linenum(len)) <= 0)
+		    (linenum = est_linenum(len, &approx)) <= 0)
 			ap_quest();
 		else
-			ap_linenum(vlinenum(linenum-1));
+			ap_est_linenum(vlinenum(linenum-1), approx);
 		break;
 	case 'm': /* Number of files */
 #if TAGS
@@ -335,13 +378,17 @@ static void protochar(int c, int where, int iseditproto)
 			ap_quest();
 		break;
 	case 'P': /* Percent into file (lines) */
-		linenum = currline(where);
+		linenum = est_currline(where, &approx);
 		if (linenum == 0 ||
 		    (len = ch_length()) == NULL_POSITION || len == ch_zero() ||
-		    (last_linenum = find_linenum(len)) <= 0)
+		    (last_linenum = est_linenum(len, &last_approx)) <= 0)
 			ap_quest();
 		else
+		{
+			if (approx || last_approx)
+				ap_char('~');
 			ap_int(percentage(linenum, last_linenum));
+		}
 		break;
 	case 's': /* Size of file */
 	case 'B':
@@ -441,7 +488,7 @@ static constant char * wherechar(char constant *p, int *wp)
 {
 	switch (*p)
 	{
-	case 'b': case 'd': case 'l': case 'p': case 'P':
+	case 'b': case 'd': case 'h': case 'l': case 'p': case 'P':
 		switch (*++p)
 		{
 		case 't':   *wp = TOP;                  break;
@@ -525,6 +572,14 @@ public char * pr_expand(constant char *proto)
  */
 public char * eq_message(void)
 {
+	POSITION len;
+
+	/*
+	 * Unlike the prompt, this waits for the line numbers
+	 * which are being counted in the background.
+	 */
+	if ((len = ch_length()) != NULL_POSITION && len != ch_zero())
+		(void) find_linenum(len);
 	return (pr_expand(eqproto));
 }
 
@@ -19,6 +19,32 @@
 #define MINPOS(a,b)     (((a) < (b)) ? (a) : (b))
 #define MAXPOS(a,b)     (((a) > (b)) ? (a) : (b))
 
+/*
+ * A long forward search through a large seekable file can be done
+ * by a pool of threads (see par_search).  Each thread needs its own
+ * copy of the compiled pattern, which rules out the libraries which
+ * keep it in static storage.
+ */
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE && HAVE_PREAD && !MSDOS_COMPILER && \
+    (HAVE_POSIX_REGCOMP || HAVE_PCRE || HAVE_PCRE2 || HAVE_GNU_REGEX || NO_REGEX)
+#define USE_PARSEARCH 1
+#include <pthread.h>
+#include <signal.h>
+#if LESSTEST
+/* A lesstest session can make the chunks smaller; see init_search. */
+static POSITION ps_chunk_size = (POSITION) (2*1024*1024);
+#define PS_CHUNK        ps_chunk_size
+#define PS_MIN_SIZE     (16*ps_chunk_size)
+#else
+#define PS_CHUNK        ((POSITION) (2*1024*1024)) /* Bytes searched by a thread at a time */
+#define PS_MIN_SIZE     ((POSITION) (32*1024*1024)) /* Don't use threads for less than this */
+#endif
+#define PS_EXTRA        (64*1024)       /* Bytes read after a chunk to finish its last line */
+#define PS_MAX_THREADS  32
+#else
+#define USE_PARSEARCH 0
+#endif
+
 extern int sigs;
 extern int how_search;
 extern int caseless;
@@ -39,6 +65,7 @@ extern int hshift;
 extern int nosearch_headers;
 extern int header_lines;
 extern int header_cols;
+extern int match_index;
 #if HILITE_SEARCH
 extern int hilite_search;
 extern int size_linebuf;
@@ -113,6 +140,9 @@ struct pattern_info {
 	char* text;
 	int search_type;
 	int is_ucase_pattern;
+	char *literal;          /* String any matching line must contain */
+	int literal_len;
+	int literal_icase;      /* Ignore case when looking for literal */
 	struct pattern_info *next;
 };
 
@@ -124,6 +154,37 @@ struct pattern_info {
 	
 static struct pattern_info search_info;
 public int is_caseless;
+#if LESSTEST
+static int no_skip_lit = FALSE; /* Don't skip lines by their literal string */
+#endif
+
+/*
+ * Buffers used by cvt_line, kept from one line to the next.
+ */
+static char *cvt_cline = NULL;
+static int *cvt_chpos = NULL;
+static int cvt_size = 0;
+
+/*
+ * An incremental search which has not finished yet.
+ * It searches a part of the file at a time, starting with a small
+ * part near the screen and doubling it each time, while the user
+ * is not typing; the next char typed cancels it.
+ */
+#define INCR_WINDOW     ((POSITION) (64*1024))  /* Bytes searched first */
+#define INCR_MAX_WINDOW ((POSITION) (16*1024*1024)) /* Most bytes searched at a time */
+#define INCR_POLL_LINES 256     /* How often to look for a typed char */
+
+static struct {
+	int active;
+	int search_type;        /* Search type, without SRCH_WRAP */
+	int wrap;               /* Wrap around at end (or start) of file */
+	POSITION pos;           /* Where to go on searching */
+	POSITION endpos;        /* Where to stop (or NULL_POSITION) */
+	POSITION startpos;      /* Where the search started */
+	POSITION opos;          /* Position of the target line on the screen */
+	POSITION window;        /* Bytes to search next time */
+} incr;
 
 /*
  * Are there any uppercase letters in this string?
@@ -147,9 +208,17 @@ static int is_ucase(char *str)
  */
 static void clear_pattern(struct pattern_info *info)
 {
+	if (info == &search_info)
+	{
+		clr_match_index();
+		incr.active = FALSE;
+	}
 	if (info->text != NULL)
 		free(info->text);
 	info->text = NULL;
+	if (info->literal != NULL)
+		free(info->literal);
+	info->literal = NULL;
 #if !NO_REGEX
 	uncompile_pattern(&info->compiled);
 #endif
@@ -164,6 +233,11 @@ static int set_pattern(struct pattern_info *info, char *pattern, int search_type
 	 * Ignore case if -I is set OR
 	 * -i is set AND the pattern is all lowercase.
 	 */
+	if (info == &search_info)
+	{
+		clr_match_index();
+		incr.active = FALSE;
+	}
 	info->is_ucase_pattern = (pattern == NULL) ? FALSE : is_ucase(pattern);
 	is_caseless = (info->is_ucase_pattern && caseless != OPT_ONPLUS) ? 0 : caseless;
 #if !NO_REGEX
@@ -181,6 +255,10 @@ static int set_pattern(struct pattern_info *info, char *pattern, int search_type
 		info->text = (char *) ecalloc(1, strlen(pattern)+1);
 		strcpy(info->text, pattern);
 	}
+	if (info->literal != NULL)
+		free(info->literal);
+	info->literal = (pattern == NULL) ? NULL :
+		pattern_literal(pattern, search_type, &info->literal_len, &info->literal_icase);
 	info->search_type = search_type;
 	return 0;
 }
@@ -192,6 +270,7 @@ static void init_pattern(struct pattern_info *info)
 {
 	SET_NULL_PATTERN(info->compiled);
 	info->text = NULL;
+	info->literal = NULL;
 	info->search_type = 0;
 	info->next = NULL;
 }
@@ -201,7 +280,27 @@ static void init_pattern(struct pattern_info *info)
  */
 public void init_search(void)
 {
+#if LESSTEST
+	char *s;
+	POSITION n;
+#endif
+
 	init_pattern(&search_info);
+#if LESSTEST
+	/*
+	 * The files in lesstest sessions are too small to be searched
+	 * by threads.  LESSTEST_CHUNK=n makes the chunks n bytes long,
+	 * so that a file of 16 chunks or more is.  LESSTEST_NOSKIP
+	 * turns off skipping lines by their literal string, so a session
+	 * can check that the results are the same either way.
+	 */
+	s = lgetenv("LESSTEST_CHUNK");
+#if USE_PARSEARCH
+	if (!isnullenv(s) && (n = lstrtopos(s, NULL, 10)) > 0)
+		ps_chunk_size = n;
+#endif
+	no_skip_lit = !isnullenv(lgetenv("LESSTEST_NOSKIP"));
+#endif
 }
 
 /*
@@ -222,6 +321,101 @@ static int get_cvt_ops(int search_type)
 	return (ops);
 }
 
+/*
+ * Return the length of the part of the n bytes at s in which 
+ * cvt_text leaves the chars of a line as they are (apart from 
+ * a CR at the end of the line), so a line in that part can contain 
+ * a string after it is converted only if it did before.
+ * The caller must not be converting to lower case.
+ */
+static int cvt_same_len(unsigned char *s, int n, int cvt_ops)
+{
+	unsigned char *p;
+	unsigned char *end = s + n;
+
+	for (p = s;  p < end;  p++)
+	{
+		if (IS_ASCII_OCTET(*p))
+		{
+			if ((*p == '\b' && (cvt_ops & CVT_BS)) ||
+			    (*p == ESC && (cvt_ops & CVT_ANSI)))
+				break;
+		} else if (utf_mode)
+		{
+			/* A malformed char is converted to a different one. */
+			if (!is_utf8_well_formed((char *) p, (int) (end - p)) ||
+			    ((cvt_ops & CVT_ANSI) && get_wchar((char *) p) == CSI))
+				break;
+			p += utf_len(*p) - 1;
+		} else if (*p == CSI && (cvt_ops & CVT_ANSI))
+			break;
+	}
+	return ((int) (p - s));
+}
+
+/*
+ * Make sure the cvt_line buffers can hold len entries.
+ */
+static void cvt_grow(int len)
+{
+	if (len > cvt_size)
+	{
+		free(cvt_cline);
+		free(cvt_chpos);
+		cvt_cline = (char *) ecalloc(len, sizeof(char));
+		cvt_chpos = (int *) ecalloc(len, sizeof(int));
+		cvt_size = len;
+	}
+}
+
+/*
+ * Convert a line for pattern matching, as cvt_text does, 
+ * into a buffer kept from one line to the next, and update *line_lenp.
+ * If the conversion would leave the line as it is (apart from 
+ * removing a CR at the end), don't copy it: return the line itself,
+ * and set *chposp to NULL; line_chpos can make the chpos array
+ * if it is needed.  Otherwise set *chposp to the chpos array.
+ * The results are valid until the next call.
+ */
+static char * cvt_line(char *line, int *line_lenp, int cvt_ops, int **chposp)
+{
+	int len = *line_lenp;
+	int i;
+
+	if (!(cvt_ops & CVT_TO_LC) && cvt_same_len((unsigned char *) line, len, cvt_ops) == len)
+	{
+		if ((cvt_ops & CVT_CRLF) && len > 0 && line[len-1] == '\r')
+			line[--len] = '\0';
+		*line_lenp = len;
+		*chposp = NULL;
+		return (line);
+	}
+	len = cvt_length(len, cvt_ops);
+	cvt_grow(len);
+	/* Initialize all entries to an invalid position. */
+	for (i = 0;  i < len;  i++)
+		cvt_chpos[i] = -1;
+	cvt_text(cvt_cline, line, cvt_chpos, line_lenp, cvt_ops);
+	*chposp = cvt_chpos;
+	return (cvt_cline);
+}
+
+/*
+ * Make the chpos array which cvt_text would have made for the len
+ * bytes at line, which cvt_line didn't convert.
+ * Only the first byte of each char is given a position.
+ */
+static int * line_chpos(char *line, int len)
+{
+	int i;
+
+	cvt_grow(len + 1);
+	for (i = 0;  i < len;  i++)
+		cvt_chpos[i] = (utf_mode && IS_UTF8_TRAIL(line[i])) ? -1 : i;
+	cvt_chpos[len] = -1;
+	return (cvt_chpos);
+}
+
 /*
  * Is there a previous (remembered) search pattern?
  */
@@ -234,6 +428,19 @@ static int prev_pattern(struct pattern_info *info)
 	return (info->text != NULL);
 }
 
+/*
+ * Might a line match a pattern?
+ * It can't if the pattern has a required literal string 
+ * which the line doesn't contain, and then we needn't run the regex.
+ */
+static int may_match(struct pattern_info *info, char *line, int line_len, int search_type)
+{
+	if (info->literal == NULL || (search_type & (SRCH_NO_MATCH|SRCH_NO_REGEX)))
+		return (TRUE);
+	return (find_literal(info->literal, info->literal_len, info->literal_icase,
+		line, line_len) != NULL);
+}
+
 #if HILITE_SEARCH
 /*
  * Repaint the hilites currently displayed on the screen.
@@ -1102,22 +1309,21 @@ static POSITION search_pos(int search_type)
  * If so, add an entry to the filter list.
  */
 #if HILITE_SEARCH
-static int matches_filters(POSITION pos, char *cline, int line_len, int *chpos, POSITION linepos, char **sp, char **ep, int nsp)
+static int matches_filters(POSITION pos, char *cline, int line_len, POSITION linepos, char **sp, char **ep, int nsp)
 {
 	struct pattern_info *filter;
 
 	for (filter = filter_infos; filter != NULL; filter = filter->next)
 	{
-		int line_filter = match_pattern(info_compiled(filter), filter->text,
-			cline, line_len, sp, ep, nsp, 0, filter->search_type);
+		int line_filter = may_match(filter, cline, line_len, filter->search_type) &&
+			match_pattern(info_compiled(filter), filter->text,
+				cline, line_len, sp, ep, nsp, 0, filter->search_type);
 		if (line_filter)
 		{
 			struct hilite hl;
 			hl.hl_startpos = linepos;
 			hl.hl_endpos = pos;
 			add_hilite(&filter_anchor, &hl);
-			free(cline);
-			free(chpos);
 			return (1);
 		}
 	}
@@ -1163,157 +1369,1299 @@ static int get_seg(POSITION pos, POSITION tpos)
 	}
 }
 
+#if USE_PARSEARCH
 /*
- * Search a subset of the file, specified by start/end position.
+ * A long forward search through a large seekable file is done by
+ * a pool of threads.  The part of the file to be searched is divided
+ * into chunks, each ending at a multiple of PS_CHUNK.  Each thread
+ * takes the next chunk, reads it with pread and counts the lines
+ * which start in the chunk and match the pattern, remembering the
+ * first of them.  Meanwhile the main thread looks at the chunks in
+ * order, and as soon as it finds the one containing the match it 
+ * wants, it goes on searching from there in the usual way.
+ * So the threads only locate the match; everything else (filters,
+ * highlighting, etc.) is done by search_range as before.
  */
-static int search_range(POSITION pos, POSITION endpos, int search_type, int matches, int maxlines, POSITION *plinepos, POSITION *pendpos, POSITION *plastlinepos)
+struct pschunk
 {
-	char *line;
-	char *cline;
-	int line_len;
-	LINENUM linenum;
-	#define NSP (NUM_SEARCH_COLORS+2)
-	char *sp[NSP];
-	char *ep[NSP];
-	int line_match;
+	POSITION pos;           /* File position of the chunk */
+	POSITION end;           /* Position after the chunk */
+	int state;              /* PS_... */
+	int count;              /* Matching lines starting in the chunk */
+	POSITION first;         /* Start of the first matching line */
+	POSITION next;          /* Start of the first line after the chunk */
+	POSITION tail;          /* Start of a last line with no newline */
+	unsigned char *ent;     /* Matching lines, if recorded (see ps_record) */
+	int entlen;
+	int entsize;
+	POSITION last;          /* Last matching line recorded */
+};
+#define PS_TODO         0
+#define PS_DONE         1
+#define PS_LONG         2       /* A line is too long; next is where it starts */
+#define PS_FAILED       3
+
+/*
+ * The state shared by the threads doing one search.
+ */
+struct psearch
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pschunk *chunks;
+	int nchunks;
+	int nextchunk;          /* Next chunk for a thread to take */
+	int merged;             /* Chunks looked at by the main thread */
+	int ahead;              /* How far ahead of merged a thread may go */
+	int stop;               /* Threads should stop */
+	int fd;                 /* File to read */
+	int cold;               /* Drop data from the system cache */
+	POSITION fend;          /* End of the file */
+	int search_type;
+	int matches;            /* Matches wanted */
 	int cvt_ops;
-	int cvt_len;
-	int *chpos;
-	POSITION linepos, oldpos;
-	int skip_bytes = 0;
-	int swidth = sc_width - line_pfx_width();
-	int sheight = sc_height - sindex_from_sline(jump_sline);
+	int record;             /* Record every matching line */
+};
+
+struct psthread
+{
+	pthread_t thread;
+	struct psearch *psp;    /* The search it is doing */
+	PATTERN_TYPE pattern;   /* The thread's own copy of the pattern */
+	unsigned char *buf;     /* Data read from the file */
+	char *cline;            /* Converted line */
+	int cline_size;
+};
+
+static struct psearch ps;
+
+/*
+ * The matching lines of a chunk are recorded as the distance of 
+ * each from the last, in a variable number of bytes: seven bits 
+ * in each, least significant first, with the top bit set in all 
+ * but the last.
+ */
+#define MI_NUMLEN       10      /* Most bytes in a number */
+
+static int mi_putnum(unsigned char *s, POSITION n)
+{
+	int len = 0;
 
-	linenum = find_linenum(pos);
-	if (nosearch_headers && linenum <= header_lines)
+	while (n >= 0x80)
 	{
-		linenum = header_lines + 1;
-		pos = find_pos(linenum);
+		s[len++] = (unsigned char) ((n & 0x7F) | 0x80);
+		n >>= 7;
 	}
-	if (pos == NULL_POSITION)
-		return (-1);
-	oldpos = pos;
-	/* When the search wraps around, end at starting position. */
-	if ((search_type & SRCH_WRAP) && endpos == NULL_POSITION)
-		endpos = pos;
-	for (;;)
+	s[len++] = (unsigned char) n;
+	return (len);
+}
+
+static POSITION mi_getnum(unsigned char **sp)
+{
+	unsigned char *s = *sp;
+	POSITION n = 0;
+	int shift = 0;
+
+	while (*s & 0x80)
 	{
-		/*
-		 * Get lines until we find a matching one or until
-		 * we hit end-of-file (or beginning-of-file if we're 
-		 * going backwards), or until we hit the end position.
-		 */
-		if (ABORT_SIGS())
+		n |= (POSITION) (*s++ & 0x7F) << shift;
+		shift += 7;
+	}
+	n |= (POSITION) *s++ << shift;
+	*sp = s;
+	return (n);
+}
+
+/*
+ * Record a matching line in a chunk.
+ */
+static int ps_record(struct pschunk *cp, POSITION pos)
+{
+	unsigned char *ent;
+	int size;
+
+	if (cp->entlen + MI_NUMLEN > cp->entsize)
+	{
+		size = (cp->entsize == 0) ? 1024 : 2 * cp->entsize;
+		ent = (unsigned char *) realloc(cp->ent, (size_t) size);
+		if (ent == NULL)
+			return (FALSE);
+		cp->ent = ent;
+		cp->entsize = size;
+	}
+	cp->entlen += mi_putnum(cp->ent + cp->entlen, pos - cp->last);
+	cp->last = pos;
+	return (TRUE);
+}
+
+/*
+ * Mark a chunk as finished and wake up the main thread.
+ */
+static void ps_finish(struct psearch *psp, struct pschunk *cp, int state)
+{
+	pthread_mutex_lock(&psp->lock);
+	cp->state = state;
+	pthread_cond_broadcast(&psp->cond);
+	pthread_mutex_unlock(&psp->lock);
+}
+
+/*
+ * Search the lines which start in one chunk.
+ */
+static void ps_chunk(struct pschunk *cp, struct psthread *tp)
+{
+	#define PS_NSP (NUM_SEARCH_COLORS+2)
+	struct psearch *psp = tp->psp;
+	char *sp[PS_NSP];
+	char *ep[PS_NSP];
+	unsigned char *s;
+	unsigned char *end;
+	unsigned char *nl;
+	char *cline;
+	POSITION rpos;
+	POSITION rend;
+	ssize_t r;
+	int len;
+	int line_len;
+
+	/*
+	 * Read the chunk, and enough after it to finish its last line,
+	 * and the byte before it, to find where its first line starts.
+	 */
+	rpos = (cp == psp->chunks) ? cp->pos : cp->pos - 1;
+	rend = cp->end + PS_EXTRA;
+	if (rend > psp->fend)
+		rend = psp->fend;
+	for (len = 0;  len < rend - rpos;  len += (int) r)
+	{
+		r = pread(psp->fd, tp->buf + len, (size_t) (rend - rpos - len), (off_t) (rpos + len));
+		if (r <= 0)
 		{
-			/*
-			 * A signal aborts the search.
-			 */
-			return (-1);
+			/* The file has shrunk, or can't be read. */
+			ps_finish(psp, cp, PS_FAILED);
+			return;
 		}
-
-		if ((endpos != NULL_POSITION && !(search_type & SRCH_WRAP) &&
-			(((search_type & SRCH_FORW) && pos >= endpos) ||
-			 ((search_type & SRCH_BACK) && pos <= endpos))) || maxlines == 0)
+	}
+#if HAVE_POSIX_FADVISE && defined(POSIX_FADV_DONTNEED)
+	if (psp->cold)
+		(void) posix_fadvise(psp->fd, (off_t) rpos, (off_t) len, POSIX_FADV_DONTNEED);
+#endif
+	s = tp->buf;
+	end = tp->buf + len;
+	if (cp != psp->chunks)
+	{
+		nl = (unsigned char *) memchr(s, '\n', (size_t) len);
+		if (nl == NULL)
 		{
-			/*
-			 * Reached end position without a match.
-			 */
-			if (pendpos != NULL)
-				*pendpos = pos;
-			return (matches);
+			if (rend == psp->fend)
+			{
+				/* No line starts in the chunk. */
+				cp->next = psp->fend;
+				ps_finish(psp, cp, PS_DONE);
+			} else
+				ps_finish(psp, cp, PS_FAILED);
+			return;
 		}
-		if (maxlines > 0)
-			maxlines--;
+		s = nl + 1;
+	}
 
-		if (search_type & SRCH_FORW)
+	for (;;)
+	{
+		cp->next = rpos + (s - tp->buf);
+		if (cp->next >= cp->end || psp->stop)
+			break;
+		nl = (unsigned char *) memchr(s, '\n', (size_t) (end - s));
+		if (nl != NULL)
+			line_len = (int) (nl - s);
+		else if (rend == psp->fend)
 		{
-			/*
-			 * Read the next line, and save the 
-			 * starting position of that line in linepos.
-			 */
-			linepos = pos;
-			pos = forw_raw_line(pos, &line, &line_len);
-			if (linenum != 0)
-				linenum++;
+			line_len = (int) (end - s);
+			cp->tail = cp->next;
 		} else
 		{
-			/*
-			 * Read the previous line and save the
-			 * starting position of that line in linepos.
-			 */
-			pos = back_raw_line(pos, &line, &line_len);
-			linepos = pos;
-			if (linenum != 0)
-				linenum--;
+			ps_finish(psp, cp, PS_LONG);
+			return;
 		}
-
-		if (pos == NULL_POSITION)
+		cline = (char *) s;
+		if (!(psp->cvt_ops & CVT_TO_LC) && cvt_same_len(s, line_len, psp->cvt_ops) == line_len)
 		{
-			/*
-			 * Reached EOF/BOF without a match.
-			 */
-			if (search_type & SRCH_WRAP)
+			/* The line needs no conversion, so match it where it is. */
+			if ((psp->cvt_ops & CVT_CRLF) && line_len > 0 && s[line_len-1] == '\r')
+				line_len--;
+			s[line_len] = '\0';
+		} else
+		{
+			len = cvt_length(line_len, psp->cvt_ops);
+			if (len > tp->cline_size)
 			{
-				/*
-				 * The search wraps around the current file, so
-				 * try to continue at BOF/EOF.
-				 */
-				if (search_type & SRCH_FORW)
-				{
-					pos = ch_zero();
-				} else
+				free(tp->cline);
+				tp->cline = (char *) malloc((size_t) len);
+				if (tp->cline == NULL)
 				{
-					pos = ch_length();
-					if (pos == NULL_POSITION)
-					{
-						(void) ch_end_seek();
-						pos = ch_length();
-					}
-				}
-				if (pos != NULL_POSITION) {
-					/*
-					 * Wrap-around was successful. Clear
-					 * the flag so we don't wrap again, and
-					 * continue the search at new pos.
-					 */
-					search_type &= ~SRCH_WRAP;
-					linenum = find_linenum(pos);
-					continue;
+					tp->cline_size = 0;
+					ps_finish(psp, cp, PS_FAILED);
+					return;
 				}
+				tp->cline_size = len;
 			}
-			if (pendpos != NULL)
-				*pendpos = oldpos;
-			return (matches);
+			cvt_text(tp->cline, (char *) s, (int *) NULL, &line_len, psp->cvt_ops);
+			cline = tp->cline;
+		}
+		if (may_match(&search_info, cline, line_len, psp->search_type) &&
+		    match_pattern(tp->pattern, search_info.text, cline, line_len, 
+				sp, ep, PS_NSP, 0, psp->search_type))
+		{
+			if (cp->count++ == 0)
+				cp->first = cp->next;
+			if (psp->record && !ps_record(cp, cp->next))
+			{
+				ps_finish(psp, cp, PS_FAILED);
+				return;
+			}
+			if (cp->count >= psp->matches)
+				/* No need to look further. */
+				break;
 		}
+		s = (nl != NULL) ? nl + 1 : end;
+	}
+	ps_finish(psp, cp, PS_DONE);
+}
 
-		/*
-		 * If we're using line numbers, we might as well
-		 * remember the information we have now (the position
-		 * and line number of the current line).
-		 * Don't do it for every line because it slows down
-		 * the search.  Remember the line number only if
-		 * we're "far" from the last place we remembered it.
-		 */
-		if (linenums && abs((int)(pos - oldpos)) > 2048)
-			add_lnum(linenum, pos);
-		oldpos = pos;
+/*
+ * Main function of a searching thread.
+ */
+static void * ps_thread(void *arg)
+{
+	struct psthread *tp = (struct psthread *) arg;
+	struct psearch *psp = tp->psp;
+	int c;
 
-#if HILITE_SEARCH
-		if (is_filtered(linepos))
-			continue;
-#endif
-		if (nosearch_headers)
-			skip_bytes = skip_columns(header_cols, &line, &line_len);
+	for (;;)
+	{
+		pthread_mutex_lock(&psp->lock);
+		while (!psp->stop && psp->nextchunk < psp->nchunks && 
+		       psp->nextchunk >= psp->merged + psp->ahead)
+			pthread_cond_wait(&psp->cond, &psp->lock);
+		if (psp->stop || psp->nextchunk >= psp->nchunks)
+		{
+			pthread_mutex_unlock(&psp->lock);
+			break;
+		}
+		c = psp->nextchunk++;
+		pthread_mutex_unlock(&psp->lock);
+		ps_chunk(&psp->chunks[c], tp);
+	}
+	return (NULL);
+}
 
-		/*
-		 * If it's a caseless search, convert the line to lowercase.
-		 * If we're doing backspace processing, delete backspaces.
+/*
+ * Divide the part of the file from pos (the start of a line)
+ * to endpos into chunks.
+ */
+static int ps_chunks(struct psearch *psp, POSITION pos, POSITION endpos)
+{
+	POSITION cpos;
+	int c;
+
+	psp->nchunks = (int) ((endpos - 1) / PS_CHUNK - pos / PS_CHUNK + 1);
+	psp->chunks = (struct pschunk *) calloc(psp->nchunks, sizeof(struct pschunk));
+	if (psp->chunks == NULL)
+		return (FALSE);
+	for (c = 0, cpos = pos;  c < psp->nchunks;  c++)
+	{
+		psp->chunks[c].pos = psp->chunks[c].last = cpos;
+		psp->chunks[c].tail = NULL_POSITION;
+		cpos = (cpos / PS_CHUNK + 1) * PS_CHUNK;
+		if (cpos > endpos)
+			cpos = endpos;
+		psp->chunks[c].end = cpos;
+	}
+	return (TRUE);
+}
+
+/*
+ * Start up to nthreads threads searching the chunks.
+ * Return the number started.
+ */
+static int ps_start(struct psearch *psp, struct psthread *threads, int nthreads)
+{
+	sigset_t mask;
+	sigset_t omask;
+	int i;
+
+	psp->nextchunk = 0;
+	psp->merged = 0;
+	psp->stop = FALSE;
+	pthread_mutex_init(&psp->lock, NULL);
+	pthread_cond_init(&psp->cond, NULL);
+
+	/*
+	 * Each thread gets its own copy of the pattern, 
+	 * since a compiled pattern may not be usable 
+	 * by more than one thread at a time.
+	 * Signals must be handled by this thread, not by the searching threads.
+	 */
+	sigfillset(&mask);
+	for (i = 0;  i < nthreads;  i++)
+	{
+		struct psthread *tp = &threads[i];
+		tp->psp = psp;
+		SET_NULL_PATTERN(tp->pattern);
+#if !NO_REGEX
+		if (!(search_info.search_type & SRCH_NO_REGEX) &&
+		    compile_pattern(search_info.text, search_info.search_type, FALSE, &tp->pattern) < 0)
+			break;
+#endif
+		tp->cline = NULL;
+		tp->cline_size = 0;
+		/* Leave room for the byte before the chunk, and a null after the data. */
+		tp->buf = (unsigned char *) malloc((size_t) (PS_CHUNK + PS_EXTRA + 2));
+		if (tp->buf != NULL)
+		{
+			pthread_sigmask(SIG_SETMASK, &mask, &omask);
+			if (pthread_create(&tp->thread, NULL, ps_thread, tp) == 0)
+			{
+				pthread_sigmask(SIG_SETMASK, &omask, NULL);
+				continue;
+			}
+			pthread_sigmask(SIG_SETMASK, &omask, NULL);
+			free(tp->buf);
+		}
+		uncompile_pattern(&tp->pattern);
+		break;
+	}
+	return (i);
+}
+
+/*
+ * Stop the threads, and free the chunks.
+ */
+static void ps_stop(struct psearch *psp, struct psthread *threads, int nthreads)
+{
+	int c;
+	int i;
+
+	pthread_mutex_lock(&psp->lock);
+	psp->stop = TRUE;
+	pthread_cond_broadcast(&psp->cond);
+	pthread_mutex_unlock(&psp->lock);
+	for (i = 0;  i < nthreads;  i++)
+	{
+		pthread_join(threads[i].thread, NULL);
+		free(threads[i].buf);
+		free(threads[i].cline);
+		uncompile_pattern(&threads[i].pattern);
+	}
+	for (c = 0;  c < psp->nchunks;  c++)
+		free(psp->chunks[c].ent);
+	free(psp->chunks);
+	pthread_cond_destroy(&psp->cond);
+	pthread_mutex_destroy(&psp->lock);
+}
+
+/*
+ * Search forward from position pos (the start of a line) to endpos
+ * with a pool of threads, for the "*matchesp"th matching line.
+ * Return the position from which search_range should carry on 
+ * searching, and set *matchesp to the number of matches it should
+ * still look for: if a chunk containing the match was found, this is 
+ * its first matching line; otherwise it is the end of the part of 
+ * the file we searched.  Return pos itself if the search can't or 
+ * shouldn't be done this way, or NULL_POSITION if it is interrupted.
+ */
+static POSITION par_search(POSITION pos, POSITION endpos, int search_type, int *matchesp)
+{
+	struct psthread threads[PS_MAX_THREADS];
+	struct pschunk *cp;
+	POSITION resume;
+	int nthreads;
+	int matches = *matchesp;
+	int state;
+	int fd;
+	int c;
+
+	if (!(search_type & SRCH_FORW) || (search_type & SRCH_FIND_ALL) || matches <= 0)
+		return (pos);
+#if HILITE_SEARCH
+	if (filter_infos != NULL)
+		return (pos);
+#endif
+	if (nosearch_headers && header_cols > 0)
+		return (pos);
+	if (!prev_pattern(&search_info))
+		return (pos);
+	if ((fd = ch_getfd()) < 0)
+		return (pos);
+	ps.fend = ch_length();
+	if (endpos == NULL_POSITION || endpos > ps.fend)
+		endpos = ps.fend;
+	if (endpos - pos < PS_MIN_SIZE)
+		return (pos);
+	nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 1)
+		return (pos);
+	if (nthreads > PS_MAX_THREADS)
+		nthreads = PS_MAX_THREADS;
+	if (!ps_chunks(&ps, pos, endpos))
+		return (pos);
+	if (nthreads > ps.nchunks)
+		nthreads = ps.nchunks;
+	ps.ahead = 2 * nthreads;
+	ps.fd = fd;
+	ps.cold = (ch_getflags() & CH_COLD) != 0;
+	ps.search_type = search_type;
+	ps.matches = matches;
+	ps.cvt_ops = get_cvt_ops(search_type);
+	ps.record = FALSE;
+	nthreads = ps_start(&ps, threads, nthreads);
+
+	/*
+	 * Look at the chunks in order, until we find the one 
+	 * containing the match we want.
+	 */
+	resume = pos;
+	for (c = 0;  c < ps.nchunks && nthreads > 0;  c++)
+	{
+		cp = &ps.chunks[c];
+		pthread_mutex_lock(&ps.lock);
+		while (cp->state == PS_TODO)
+			pthread_cond_wait(&ps.cond, &ps.lock);
+		state = cp->state;
+		pthread_mutex_unlock(&ps.lock);
+		if (ABORT_SIGS())
+		{
+			resume = NULL_POSITION;
+			break;
+		}
+		if (state == PS_FAILED)
+			break;
+		if (cp->count >= matches)
+		{
+			resume = cp->first;
+			break;
+		}
+		matches -= cp->count;
+		resume = cp->next;
+		if (state == PS_LONG)
+			break;
+		pthread_mutex_lock(&ps.lock);
+		ps.merged = c + 1;
+		pthread_cond_broadcast(&ps.cond);
+		pthread_mutex_unlock(&ps.lock);
+	}
+
+	ps_stop(&ps, threads, nthreads);
+	*matchesp = matches;
+	return (resume);
+}
+
+/*
+ * The match index holds the positions of the lines in the file which
+ * match the search pattern.  It is built in the background by a pool
+ * of threads, searching the file a chunk at a time as par_search does
+ * but recording every matching line, while the main thread adds the
+ * chunks to the index in order (see mi_merge).  The part of the file
+ * before mi.end has been indexed, and if the file grows, the index is
+ * extended from there.  This is done with the --match-index option, 
+ * or when the ESC-g command needs it.
+ * The matches are kept in blocks of MI_BLOCK: the position of the first
+ * match of each block, and the distance of each of the rest from the
+ * one before it, encoded as in the chunks.  So a match is found by a
+ * binary search of the blocks, and a short scan of one of them.
+ */
+#define MI_BLOCK        64      /* Matches in a block */
+#define MI_POLL_MS      100     /* How often to look at the threads' progress */
+#define MI_LONGTIME     2       /* Seconds before showing progress */
+
+static struct
+{
+	int valid;              /* Is there an index for this pattern and file? */
+	int failed;             /* Can't index any further */
+	int search_type;        /* Search type of the pattern */
+	int cvt_ops;
+	unsigned char *data;    /* Distances between matches */
+	size_t len;
+	size_t size;
+	size_t lastlen;         /* Length of data before the last match */
+	POSITION *bpos;         /* First match of each block */
+	size_t *boff;           /* Where the rest of each block is in data */
+	LINENUM nblocks;
+	LINENUM maxblocks;
+	LINENUM count;          /* Number of matches */
+	POSITION last;          /* Last match */
+	POSITION end;           /* End of the part of the file indexed */
+	POSITION tail;          /* Start of a last line with no newline */
+} mi;
+
+static struct psearch mx;       /* The threads extending the index */
+static struct psthread mx_threads[PS_MAX_THREADS];
+static int mx_nthreads = 0;
+
+/*
+ * Add a match to the end of the index.
+ */
+static int mi_add(POSITION pos)
+{
+	POSITION *bpos;
+	size_t *boff;
+	unsigned char *data;
+	LINENUM max;
+	size_t size;
+
+	if (mi.count % MI_BLOCK == 0)
+	{
+		if (mi.nblocks >= mi.maxblocks)
+		{
+			max = (mi.maxblocks == 0) ? 64 : 2 * mi.maxblocks;
+			bpos = (POSITION *) realloc(mi.bpos, (size_t) max * sizeof(POSITION));
+			if (bpos == NULL)
+				return (FALSE);
+			mi.bpos = bpos;
+			boff = (size_t *) realloc(mi.boff, (size_t) max * sizeof(size_t));
+			if (boff == NULL)
+				return (FALSE);
+			mi.boff = boff;
+			mi.maxblocks = max;
+		}
+		mi.bpos[mi.nblocks] = pos;
+		mi.boff[mi.nblocks] = mi.len;
+		mi.nblocks++;
+		mi.lastlen = mi.len;
+	} else
+	{
+		if (mi.len + MI_NUMLEN > mi.size)
+		{
+			size = (mi.size == 0) ? 4096 : 2 * mi.size;
+			data = (unsigned char *) realloc(mi.data, size);
+			if (data == NULL)
+				return (FALSE);
+			mi.data = data;
+			mi.size = size;
+		}
+		mi.lastlen = mi.len;
+		mi.len += mi_putnum(mi.data + mi.len, pos - mi.last);
+	}
+	mi.count++;
+	mi.last = pos;
+	return (TRUE);
+}
+
+/*
+ * Return the position of match n (counting from 0).
+ */
+static POSITION mi_pos(LINENUM n)
+{
+	LINENUM b = n / MI_BLOCK;
+	unsigned char *s = mi.data + mi.boff[b];
+	POSITION pos = mi.bpos[b];
+
+	for (n -= b * MI_BLOCK;  n > 0;  n--)
+		pos += mi_getnum(&s);
+	return (pos);
+}
+
+/*
+ * Return the number of matches before position pos.
+ */
+static LINENUM mi_find(POSITION pos)
+{
+	LINENUM lo = 0;
+	LINENUM hi = mi.nblocks;
+	LINENUM m;
+	LINENUM n;
+	POSITION mpos;
+	unsigned char *s;
+
+	/* Find the first block which starts at or after pos. */
+	while (lo < hi)
+	{
+		m = (lo + hi) / 2;
+		if (mi.bpos[m] < pos)
+			lo = m + 1;
+		else
+			hi = m;
+	}
+	if (lo == 0)
+		return (0);
+	/* The matches before pos end in the block before that. */
+	n = (lo - 1) * MI_BLOCK + 1;
+	s = mi.data + mi.boff[lo - 1];
+	mpos = mi.bpos[lo - 1];
+	for (;  n < mi.count && n % MI_BLOCK != 0;  n++)
+	{
+		mpos += mi_getnum(&s);
+		if (mpos >= pos)
+			break;
+	}
+	return (n);
+}
+
+/*
+ * Is the whole file indexed?
+ */
+static int mi_done(void)
+{
+	return (mi.valid && mx_nthreads == 0 && !mi.failed && mi.end >= ch_length());
+}
+
+/*
+ * Stop the threads extending the index.
+ */
+static void mx_stop(void)
+{
+	if (mx_nthreads == 0)
+		return;
+	ps_stop(&mx, mx_threads, mx_nthreads);
+	mx_nthreads = 0;
+}
+
+/*
+ * Add the matches of the chunks which are done to the index, in order.
+ * If wait is TRUE and the next chunk is not done yet, first wait for it.
+ * Stop the threads when all the chunks are done, or one can't be.
+ */
+static void mi_merge(int wait)
+{
+	struct pschunk *cp;
+	unsigned char *s;
+	POSITION pos;
+	int state;
+	int n;
+
+	while (mx_nthreads > 0)
+	{
+		if (mx.merged >= mx.nchunks)
+		{
+			mx_stop();
+			break;
+		}
+		cp = &mx.chunks[mx.merged];
+		pthread_mutex_lock(&mx.lock);
+		while (wait && cp->state == PS_TODO)
+			pthread_cond_wait(&mx.cond, &mx.lock);
+		state = cp->state;
+		pthread_mutex_unlock(&mx.lock);
+		if (state == PS_TODO)
+			break;
+		if (state == PS_DONE)
+		{
+			s = cp->ent;
+			pos = cp->pos;
+			for (n = 0;  n < cp->count;  n++)
+			{
+				pos += mi_getnum(&s);
+				if (!mi_add(pos))
+				{
+					state = PS_FAILED;
+					break;
+				}
+			}
+		}
+		if (state != PS_DONE)
+		{
+			/* A line is too long, or we are out of memory. */
+			mi.failed = TRUE;
+			mx_stop();
+			break;
+		}
+		mi.end = cp->next;
+		mi.tail = cp->tail;
+		free(cp->ent);
+		cp->ent = NULL;
+		mx.merged++;
+		wait = FALSE;
+	}
+}
+
+/*
+ * Start threads to extend the index to the end of the file.
+ */
+static void mi_start(void)
+{
+	POSITION len;
+	int nthreads;
+	int fd;
+
+	if ((fd = ch_getfd()) < 0 || (len = ch_length()) == NULL_POSITION)
+		return;
+	if (!mi.valid)
+	{
+		mi.valid = TRUE;
+		mi.failed = FALSE;
+		mi.search_type = search_info.search_type;
+		mi.cvt_ops = get_cvt_ops(search_info.search_type);
+		mi.len = 0;
+		mi.nblocks = 0;
+		mi.count = 0;
+		mi.end = ch_zero();
+		mi.tail = NULL_POSITION;
+	} else if (mi.tail != NULL_POSITION)
+	{
+		/* The last line was incomplete, so index it again. */
+		if (mi.count > 0 && mi.last == mi.tail)
+		{
+			mi.count--;
+			if (mi.count % MI_BLOCK == 0)
+				mi.nblocks--;
+			mi.len = mi.lastlen;
+			if (mi.count > 0)
+				mi.last = mi_pos(mi.count - 1);
+		}
+		mi.end = mi.tail;
+		mi.tail = NULL_POSITION;
+	}
+	if (len <= mi.end)
+		return;
+	nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	else if (nthreads > PS_MAX_THREADS)
+		nthreads = PS_MAX_THREADS;
+	if (!ps_chunks(&mx, mi.end, len))
+	{
+		mi.failed = TRUE;
+		return;
+	}
+	if (nthreads > mx.nchunks)
+		nthreads = mx.nchunks;
+	/* The chunks are small once recorded, so let the threads run ahead. */
+	mx.ahead = mx.nchunks;
+	mx.fd = fd;
+	mx.cold = (ch_getflags() & CH_COLD) != 0;
+	mx.fend = len;
+	mx.search_type = mi.search_type;
+	mx.matches = INT_MAX;
+	mx.cvt_ops = mi.cvt_ops;
+	mx.record = TRUE;
+	mx_nthreads = ps_start(&mx, mx_threads, nthreads);
+	if (mx_nthreads == 0)
+	{
+		ps_stop(&mx, mx_threads, 0);
+		mi.failed = TRUE;
+	}
+}
+
+/*
+ * Can the matches of the search pattern be indexed?
+ * Not if they depend on more than the lines themselves.
+ */
+static int mi_usable(void)
+{
+	if (!prev_pattern(&search_info) || ch_getfd() < 0)
+		return (FALSE);
+	if (nosearch_headers && (header_lines > 0 || header_cols > 0))
+		return (FALSE);
+#if HILITE_SEARCH
+	if (filter_infos != NULL)
+		return (FALSE);
+#endif
+	return (TRUE);
+}
+
+/*
+ * Make sure the match index, if there is one, is still right for
+ * the search pattern and the file, and add to it the matches found 
+ * since we last looked.  If the file has grown, extend the index.
+ * If there is no index and start is TRUE, start one.
+ * Return whether there is an index (which may be incomplete).
+ */
+static int mi_check(int start)
+{
+	POSITION len;
+
+	if (!mi.valid && !start)
+		return (FALSE);
+	if (!mi_usable())
+	{
+		clr_match_index();
+		return (FALSE);
+	}
+	if (mi.valid && mi.cvt_ops != get_cvt_ops(search_info.search_type))
+		clr_match_index();
+	mi_merge(FALSE);
+	len = ch_length();
+	if (mi.valid && len != NULL_POSITION && len < mi.end)
+		/* The file has shrunk. */
+		clr_match_index();
+	if ((mi.valid || start) && !mi.failed && mx_nthreads == 0 &&
+	    len != NULL_POSITION && (!mi.valid || len > mi.end))
+		mi_start();
+	return (mi.valid);
+}
+
+/*
+ * Find the "*matchesp"th line matching the search pattern from
+ * position pos (the start of a line) in the direction of the search,
+ * in the match index.  If it is found, set *ppos to the position from
+ * which search_range should read it next, set *matchesp to 1 and
+ * return TRUE.  Otherwise, if the index covers part of the range to 
+ * be searched, set *ppos to the end of that part and reduce *matchesp
+ * by the matches in it.
+ */
+static int idx_search(POSITION *ppos, POSITION endpos, int search_type, int *matchesp)
+{
+	POSITION pos = *ppos;
+	POSITION lim;
+	POSITION npos;
+	LINENUM k;
+	LINENUM n;
+	int matches = *matchesp;
+
+	if ((search_type & SRCH_FIND_ALL) || matches <= 0 ||
+	    !mi_check(match_index && !(search_type & SRCH_INCR)))
+		return (FALSE);
+	if ((search_type & (SRCH_NO_MATCH|SRCH_NO_REGEX)) !=
+	    (mi.search_type & (SRCH_NO_MATCH|SRCH_NO_REGEX)))
+		return (FALSE);
+	if (search_type & SRCH_FORW)
+	{
+		lim = mi.end;
+		if (endpos != NULL_POSITION && !(search_type & SRCH_WRAP) && endpos < lim)
+			lim = endpos;
+		if (lim <= pos)
+			return (FALSE);
+		k = mi_find(pos);
+		n = mi_find(lim) - k;
+		if (n >= matches)
+		{
+			*ppos = mi_pos(k + matches - 1);
+			*matchesp = 1;
+			return (TRUE);
+		}
+	} else
+	{
+		if (pos > mi.end)
+			return (FALSE);
+		lim = ch_zero();
+		if (endpos != NULL_POSITION && !(search_type & SRCH_WRAP) && endpos > lim)
+			lim = endpos;
+		if (lim >= pos)
+			return (FALSE);
+		k = mi_find(pos);
+		n = k - mi_find(lim);
+		if (n >= matches)
+		{
+			/* Carry on from the end of the matching line, so it is read next. */
+			npos = forw_raw_line(mi_pos(k - matches), NULL, NULL);
+			if (npos == NULL_POSITION)
+				return (FALSE);
+			*ppos = npos;
+			*matchesp = 1;
+			return (TRUE);
+		}
+	}
+	*ppos = lim;
+	*matchesp = matches - (int) n;
+	return (FALSE);
+}
+#endif
+
+/*
+ * Discard the match index.
+ */
+public void clr_match_index(void)
+{
+#if USE_PARSEARCH
+	mx_stop();
+	free(mi.data);
+	free(mi.bpos);
+	free(mi.boff);
+	mi.data = NULL;
+	mi.bpos = NULL;
+	mi.boff = NULL;
+	mi.size = 0;
+	mi.maxblocks = 0;
+	mi.valid = FALSE;
+	mi.failed = FALSE;
+#endif
+}
+
+/*
+ * Return the number of lines in the file matching the search pattern,
+ * as far as the match index has got, or -1 if there is no index.
+ * Set *donep to whether the whole file has been indexed.
+ */
+public LINENUM match_index_count(int *donep)
+{
+	*donep = FALSE;
+#if USE_PARSEARCH
+	if (mi_check(match_index))
+	{
+		*donep = mi_done();
+		return (mi.count);
+	}
+#endif
+	return (-1);
+}
+
+/*
+ * Return the number of lines matching the search pattern 
+ * up to and including the one at position pos, 
+ * or -1 if the match index doesn't know.
+ */
+public LINENUM match_index_rank(POSITION pos)
+{
+#if USE_PARSEARCH
+	if (pos != NULL_POSITION && mi_check(match_index) && (pos < mi.end || mi_done()))
+		return (mi_find(pos + 1));
+#endif
+	return (-1);
+}
+
+/*
+ * Return the position of the n-th line in the file matching the 
+ * search pattern, waiting for the match index to get that far.
+ * Return NULL_POSITION if there is no such line.
+ */
+public POSITION match_index_pos(LINENUM n)
+{
+#if USE_PARSEARCH
+	PARG parg;
+	int pct = -1;
+#if HAVE_TIME
+	time_type stime = get_time();
+#endif
+
+	if (!prev_pattern(&search_info))
+	{
+		error("No previous regular expression", NULL_PARG);
+		return (NULL_POSITION);
+	}
+	if (!mi_check(TRUE))
+	{
+		error("Cannot index the matches in this file", NULL_PARG);
+		return (NULL_POSITION);
+	}
+	while (mi.count < n && mx_nthreads > 0)
+	{
+		if (ABORT_SIGS())
+			return (NULL_POSITION);
+		mi_merge(TRUE);
+#if HAVE_TIME
+		if (get_time() < stime + MI_LONGTIME)
+			continue;
+#endif
+		if (percentage(mi.end, mx.fend) != pct)
+		{
+			pct = percentage(mi.end, mx.fend);
+			parg.p_int = pct;
+			ierror("Indexing matches (%d%%)", &parg);
+		}
+	}
+	if (n > mi.count)
+	{
+		if (!mi_done())
+			error("Cannot index all the matches in this file", NULL_PARG);
+		else if (mi.count == 0)
+			error("Pattern not found", NULL_PARG);
+		else
+		{
+			parg.p_linenum = mi.count;
+			error("Only %n matching lines", &parg);
+		}
+		return (NULL_POSITION);
+	}
+	return (mi_pos(n - 1));
+#else
+	error("Command not available", NULL_PARG);
+	return (NULL_POSITION);
+#endif
+}
+
+/*
+ * Wait for input from the user.  Meanwhile, if the match index
+ * is being built, return TRUE whenever more of it is known,
+ * so the prompt can show it.
+ */
+public int match_index_wait(void)
+{
+#if USE_PARSEARCH
+	LINENUM count;
+
+	while (mx_nthreads > 0)
+	{
+		count = mi.count;
+		if (tty_ready(MI_POLL_MS))
+			return (FALSE);
+		mi_merge(FALSE);
+		if (mx_nthreads == 0 || mi.count != count)
+			return (TRUE);
+	}
+#endif
+	return (FALSE);
+}
+
+/*
+ * Skip forward from pos (the start of a line) over the lines which
+ * can't match the search pattern because they don't contain its 
+ * required literal string.  Rather than reading the lines one at 
+ * a time, look for the string in the file buffers a span at a time.
+ * Stop at a line which may match, at endpos, or where we can't tell.
+ * Return the position of the line we stopped at.
+ */
+static POSITION skip_nomatch(POSITION pos, POSITION endpos, int cvt_ops)
+{
+	unsigned char *s;
+	unsigned char *e;
+	char *f;
+	int len;
+
+	if (ch_seek(pos))
+		return (pos);
+	while (endpos == NULL_POSITION || pos < endpos)
+	{
+		if (ABORT_SIGS())
+			break;
+		len = ch_forw_span(&s);
+		if (endpos != NULL_POSITION && len > endpos - pos)
+			len = (int) (endpos - pos);
+		/*
+		 * Find the start of the first line containing the string,
+		 * or the end of the last whole line if there is none.
+		 */
+		f = find_literal(search_info.literal, search_info.literal_len,
+			search_info.literal_icase, (char *) s, len);
+		for (e = (f != NULL) ? (unsigned char *) f : s + len;  e > s && e[-1] != '\n';  e--)
+			continue;
+		/* The lines before it must look the same after conversion. */
+		len = cvt_same_len(s, (int) (e - s), cvt_ops);
+		if (s + len < e)
+		{
+			for (e = s + len;  e > s && e[-1] != '\n';  e--)
+				continue;
+			f = (char *) s;
+		}
+		if (e == s)
+			break;
+		ch_skip(e - s);
+		pos += e - s;
+		if (f != NULL)
+			break;
+	}
+	return (pos);
+}
+
+/*
+ * Search a subset of the file, specified by start/end position.
+ */
+static int search_range(POSITION pos, POSITION endpos, int search_type, int matches, int maxlines, POSITION *plinepos, POSITION *pendpos, POSITION *plastlinepos)
+{
+	char *line;
+	char *cline;
+	int line_len;
+	LINENUM linenum;
+	#define NSP (NUM_SEARCH_COLORS+2)
+	char *sp[NSP];
+	char *ep[NSP];
+	int line_match;
+	int cvt_ops;
+	int raw_len;
+	int *chpos;
+	POSITION linepos, oldpos;
+	POSITION spos;
+	int skip_lit;
+	int npoll = 0;
+#if USE_PARSEARCH
+	POSITION ppos;
+	int try_par = (maxlines < 0);
+#endif
+	int skip_bytes = 0;
+	int swidth = sc_width - line_pfx_width();
+	int sheight = sc_height - sindex_from_sline(jump_sline);
+
+	/*
+	 * If line numbers are being calculated in the background and this
+	 * one is not known yet, it is far from the start of the file,
+	 * so it is not in the header.
+	 */
+	linenum = known_linenum(pos);
+	if (nosearch_headers && linenum <= header_lines && (linenum != 0 || !linenums))
+	{
+		linenum = header_lines + 1;
+		pos = find_pos(linenum);
+	}
+	if (pos == NULL_POSITION)
+		return (-1);
+	oldpos = pos;
+	/* When the search wraps around, end at starting position. */
+	if ((search_type & SRCH_WRAP) && endpos == NULL_POSITION)
+		endpos = pos;
+	/*
+	 * In a long forward search, skip the lines which don't contain
+	 * the pattern's required literal string in bulk, unless they 
+	 * must be looked at for some other reason.
+	 */
+	skip_lit = (maxlines < 0 && (search_type & SRCH_FORW) && search_info.literal != NULL &&
+		!(search_type & (SRCH_NO_MATCH|SRCH_NO_REGEX)) &&
+		!(get_cvt_ops(search_type) & CVT_TO_LC));
+#if HILITE_SEARCH
+	if (filter_infos != NULL)
+		skip_lit = FALSE;
+#endif
+#if LESSTEST
+	if (no_skip_lit)
+		skip_lit = FALSE;
+#endif
+	for (;;)
+	{
+		/*
+		 * Get lines until we find a matching one or until
+		 * we hit end-of-file (or beginning-of-file if we're 
+		 * going backwards), or until we hit the end position.
+		 */
+		if (ABORT_SIGS())
+		{
+			/*
+			 * A signal aborts the search.
+			 */
+			return (-1);
+		}
+		if ((search_type & SRCH_INCR) && incr.active &&
+		    ++npoll % INCR_POLL_LINES == 0 && tty_ready(0))
+		{
+			/*
+			 * So does a char typed during an incremental search.
+			 */
+			return (-1);
+		}
+#if USE_PARSEARCH
+		if (try_par)
+		{
+			/*
+			 * Find the match in the match index, if there is one.
+			 * Otherwise, or if it's after the part of the file 
+			 * indexed so far, let a pool of threads find the part of 
+			 * the file where the match is, if it's worth it.
+			 */
+			try_par = FALSE;
+			ppos = pos;
+			if (!idx_search(&ppos, endpos, search_type, &matches))
+				ppos = par_search(ppos, (search_type & SRCH_WRAP) ? NULL_POSITION : endpos,
+					search_type, &matches);
+			if (ppos == NULL_POSITION)
+				return (-1);
+			if (ppos != pos)
+			{
+				pos = oldpos = ppos;
+				linenum = 0;
+			}
+		}
+#endif
+		if (skip_lit)
+		{
+			spos = skip_nomatch(pos, (search_type & SRCH_WRAP) ? NULL_POSITION : endpos,
+				get_cvt_ops(search_type));
+			if (spos != pos)
+			{
+				pos = oldpos = spos;
+				linenum = 0;
+			}
+		}
+
+		if ((endpos != NULL_POSITION && !(search_type & SRCH_WRAP) &&
+			(((search_type & SRCH_FORW) && pos >= endpos) ||
+			 ((search_type & SRCH_BACK) && pos <= endpos))) || maxlines == 0)
+		{
+			/*
+			 * Reached end position without a match.
+			 */
+			if (pendpos != NULL)
+				*pendpos = pos;
+			return (matches);
+		}
+		if (maxlines > 0)
+			maxlines--;
+
+		if (search_type & SRCH_FORW)
+		{
+			/*
+			 * Read the next line, and save the 
+			 * starting position of that line in linepos.
+			 */
+			linepos = pos;
+			pos = forw_raw_line(pos, &line, &line_len);
+			if (linenum != 0)
+				linenum++;
+		} else
+		{
+			/*
+			 * Read the previous line and save the
+			 * starting position of that line in linepos.
+			 */
+			pos = back_raw_line(pos, &line, &line_len);
+			linepos = pos;
+			if (linenum != 0)
+				linenum--;
+		}
+
+		if (pos == NULL_POSITION)
+		{
+			/*
+			 * Reached EOF/BOF without a match.
+			 */
+			if (search_type & SRCH_WRAP)
+			{
+				/*
+				 * The search wraps around the current file, so
+				 * try to continue at BOF/EOF.
+				 */
+				if (search_type & SRCH_FORW)
+				{
+					pos = ch_zero();
+				} else
+				{
+					pos = ch_length();
+					if (pos == NULL_POSITION)
+					{
+						(void) ch_end_seek();
+						pos = ch_length();
+					}
+				}
+				if (pos != NULL_POSITION) {
+					/*
+					 * Wrap-around was successful. Clear
+					 * the flag so we don't wrap again, and
+					 * continue the search at new pos.
+					 */
+					search_type &= ~SRCH_WRAP;
+					linenum = known_linenum(pos);
+#if USE_PARSEARCH
+					try_par = (maxlines < 0);
+#endif
+					continue;
+				}
+			}
+			if (pendpos != NULL)
+				*pendpos = oldpos;
+			return (matches);
+		}
+
+		/*
+		 * If we're using line numbers, we might as well
+		 * remember the information we have now (the position
+		 * and line number of the current line).
+		 * Don't do it for every line because it slows down
+		 * the search.  Remember the line number only if
+		 * we're "far" from the last place we remembered it.
+		 */
+		if (linenums && linenum != 0 && abs((int)(pos - oldpos)) > 2048)
+			add_lnum(linenum, pos);
+		oldpos = pos;
+
+#if HILITE_SEARCH
+		if (is_filtered(linepos))
+			continue;
+#endif
+		if (nosearch_headers)
+			skip_bytes = skip_columns(header_cols, &line, &line_len);
+
+		/*
+		 * If it's a caseless search, convert the line to lowercase.
+		 * If we're doing backspace processing, delete backspaces.
 		 */
 		cvt_ops = get_cvt_ops(search_type);
-		cvt_len = cvt_length(line_len, cvt_ops);
-		cline = (char *) ecalloc(1, cvt_len);
-		chpos = cvt_alloc_chpos(cvt_len);
-		cvt_text(cline, line, chpos, &line_len, cvt_ops);
+		raw_len = line_len;
+		cline = cvt_line(line, &line_len, cvt_ops, &chpos);
 
 #if HILITE_SEARCH
 		/*
@@ -1323,7 +2671,7 @@ static int search_range(POSITION pos, POSITION endpos, int search_type, int matc
 		   ((search_type & SRCH_FIND_ALL) ||
 		     prep_startpos == NULL_POSITION ||
 		     linepos < prep_startpos || linepos >= prep_endpos)) {
-			if (matches_filters(pos, cline, line_len, chpos, linepos, sp, ep, NSP))
+			if (matches_filters(pos, cline, line_len, linepos, sp, ep, NSP))
 				continue;
 		}
 #endif
@@ -1335,13 +2683,16 @@ static int search_range(POSITION pos, POSITION endpos, int search_type, int matc
 		 */
 		if (prev_pattern(&search_info))
 		{
-			line_match = match_pattern(info_compiled(&search_info), search_info.text,
-				cline, line_len, sp, ep, NSP, 0, search_type);
+			line_match = may_match(&search_info, cline, line_len, search_type) &&
+				match_pattern(info_compiled(&search_info), search_info.text,
+					cline, line_len, sp, ep, NSP, 0, search_type);
 			if (line_match)
 			{
 				/*
 				 * Got a match.
 				 */
+				if (chpos == NULL)
+					chpos = line_chpos(cline, raw_len);
 				if (search_type & SRCH_FIND_ALL)
 				{
 #if HILITE_SEARCH
@@ -1377,14 +2728,18 @@ static int search_range(POSITION pos, POSITION endpos, int search_type, int matc
 						 */
 						if (sp[0] != NULL && ep[0] != NULL)
 						{
-							int start_off = sp[0] - cline;
-							int end_off = ep[0] - cline;
+							/*
+							 * get_seg may search other lines, 
+							 * so chpos is not valid after it.
+							 */
+							POSITION start_pos = linepos + chpos[sp[0] - cline];
+							POSITION end_pos = linepos + chpos[ep[0] - cline];
 							int save_hshift = hshift;
 							int sshift;
 							int eshift;
 							hshift = 0; /* make get_seg count screen lines */
-							sshift = swidth * get_seg(linepos, linepos + chpos[start_off]);
-							eshift = swidth * get_seg(linepos, linepos + chpos[end_off]);
+							sshift = swidth * get_seg(linepos, start_pos);
+							eshift = swidth * get_seg(linepos, end_pos);
 							if (sshift >= save_hshift && eshift <= save_hshift)
 							{
 								hshift = save_hshift;
@@ -1411,16 +2766,12 @@ static int search_range(POSITION pos, POSITION endpos, int search_type, int matc
 								*plastlinepos = get_lastlinepos(linepos, linepos + chpos[end_off], sheight);
 						}
 					}
-					free(cline);
-					free(chpos);
 					if (plinepos != NULL)
 						*plinepos = linepos;
 					return (0);
 				}
 			}
 		}
-		free(cline);
-		free(chpos);
 	}
 }
 
@@ -1479,6 +2830,31 @@ public void chg_caseless(void)
 	(void) hist_pattern(search_info.search_type);
 }
 
+/*
+ * Go to a line found by a search, and highlight the match.
+ */
+static void search_found(int search_type, POSITION pos, POSITION opos, POSITION lastlinepos)
+{
+	if (!(search_type & SRCH_NO_MOVE))
+	{
+		/*
+		 * Go to the matching line.
+		 */
+		if (lastlinepos != NULL_POSITION)
+			jump_loc(lastlinepos, BOTTOM);
+		else if (pos != opos)
+			jump_loc(pos, jump_sline);
+	}
+
+#if HILITE_SEARCH
+	if (hilite_search == OPT_ON || status_col)
+		/*
+		 * Display new hilites in the matching line.
+		 */
+		repaint_hilite(1);
+#endif
+}
+
 /*
  * Search for the n-th occurrence of a specified pattern, 
  * either forward or backward.
@@ -1494,6 +2870,7 @@ public int search(int search_type, char *pattern, int n)
 	POSITION opos;
 	POSITION lastlinepos = NULL_POSITION;
 
+	incr.active = FALSE;
 	if (pattern == NULL || *pattern == '\0')
 	{
 		/*
@@ -1584,6 +2961,23 @@ public int search(int search_type, char *pattern, int n)
 		return (-1);
 	}
 
+	if ((search_type & SRCH_INCR) && supports_ctrl_x())
+	{
+		/*
+		 * Search only the part of the file near the screen now,
+		 * and the rest while the user is not typing
+		 * (see incr_search_more).
+		 */
+		incr.active = TRUE;
+		incr.search_type = search_type & ~SRCH_WRAP;
+		incr.wrap = (search_type & SRCH_WRAP) != 0;
+		incr.pos = incr.startpos = pos;
+		incr.endpos = NULL_POSITION;
+		incr.opos = opos;
+		incr.window = INCR_WINDOW;
+		return (incr_search_more());
+	}
+
 	n = search_range(pos, NULL_POSITION, search_type, n, -1,
 			&pos, (POSITION*)NULL, &lastlinepos);
 	if (n != 0)
@@ -1600,26 +2994,102 @@ public int search(int search_type, char *pattern, int n)
 #endif
 		return (n);
 	}
+	search_found(search_type, pos, opos, lastlinepos);
+	return (0);
+}
 
-	if (!(search_type & SRCH_NO_MOVE))
+/*
+ * Is an incremental search still searching the file?
+ */
+public int incr_search_pending(void)
+{
+	return (incr.active);
+}
+
+/*
+ * Search the next part of the file for an incremental search,
+ * and make the part searched next time bigger.
+ * Return 0 if a match is found, -1 if the search was interrupted,
+ * or 1 if there is no match (yet; see incr_search_pending).
+ * A search interrupted by a typed char is still pending,
+ * and goes on with the same part next time.
+ */
+public int incr_search_more(void)
+{
+	POSITION pos;
+	POSITION epos;
+	POSITION wpos;
+	POSITION lim;
+	POSITION lastlinepos = NULL_POSITION;
+	int more;
+	int n;
+
+	if (!incr.active)
+		return (-1);
+	if (incr.search_type & SRCH_FORW)
+	{
+		wpos = incr.pos + incr.window;
+		more = (incr.endpos == NULL_POSITION || wpos < incr.endpos);
+		if (!more)
+			wpos = incr.endpos;
+	} else
+	{
+		wpos = incr.pos - incr.window;
+		lim = (incr.endpos == NULL_POSITION) ? ch_zero() : incr.endpos;
+		more = (wpos > lim);
+		if (!more)
+			wpos = lim;
+	}
+	epos = wpos;
+	n = search_range(incr.pos, wpos, incr.search_type, 1, -1,
+			&pos, &epos, &lastlinepos);
+	if (n < 0 && !ABORT_SIGS())
+		return (-1);
+	if (n <= 0)
+	{
+		incr.active = FALSE;
+		if (n == 0)
+		{
+			/* The search prompt is erased as the screen changes. */
+			clear_bot();
+			search_found(incr.search_type, pos, incr.opos, lastlinepos);
+		}
+		return (n);
+	}
+	if (more && ((incr.search_type & SRCH_BACK) || epos >= wpos))
 	{
 		/*
-		 * Go to the matching line.
+		 * Not at the end of the file yet.
 		 */
-		if (lastlinepos != NULL_POSITION)
-			jump_loc(lastlinepos, BOTTOM);
-		else if (pos != opos)
-			jump_loc(pos, jump_sline);
+		incr.pos = epos;
+		if (incr.window < INCR_MAX_WINDOW)
+			incr.window *= 2;
+		return (1);
 	}
-
-#if HILITE_SEARCH
-	if (hilite_search == OPT_ON || status_col)
+	if (incr.wrap)
+	{
 		/*
-		 * Display new hilites in the matching line.
+		 * Go on from the other end of the file
+		 * to where the search started.
 		 */
-		repaint_hilite(1);
-#endif
-	return (0);
+		incr.wrap = FALSE;
+		incr.endpos = incr.startpos;
+		if (incr.search_type & SRCH_FORW)
+			incr.pos = ch_zero();
+		else
+		{
+			incr.pos = ch_length();
+			if (incr.pos == NULL_POSITION)
+			{
+				(void) ch_end_seek();
+				incr.pos = ch_length();
+			}
+		}
+		if (incr.pos != NULL_POSITION)
+			return (1);
+	}
+	incr.active = FALSE;
+	return (1);
 }
 
 #if HILITE_SEARCH
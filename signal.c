@@ -128,6 +128,27 @@ static BOOL WINAPI wbreak_handler(DWORD dwCtrlType)
 }
 #endif
 
+#ifdef SIGBUS
+/*
+ * Bus error handler.
+ * This may be caused by reading a mapped file which has been truncated.
+ */
+	/* ARGSUSED*/
+static RETSIGTYPE sigbus(int type)
+{
+	if (!ch_mapfault())
+	{
+		/* Not ours: let the fault happen again and kill us. */
+		LSIGNAL(SIGBUS, SIG_DFL);
+		return;
+	}
+	LSIGNAL(SIGBUS, sigbus);
+	command_fault();
+	/* Too early to recover; give up. */
+	LSIGNAL(SIGBUS, SIG_DFL);
+}
+#endif
+
 static RETSIGTYPE terminate(int type)
 {
 	quit(15);
@@ -162,6 +183,9 @@ public void init_signals(int on)
 #endif
 #ifdef SIGTERM
 		(void) LSIGNAL(SIGTERM, terminate);
+#endif
+#ifdef SIGBUS
+		(void) LSIGNAL(SIGBUS, sigbus);
 #endif
 	} else
 	{
@@ -187,6 +211,9 @@ public void init_signals(int on)
 #endif
 #ifdef SIGTERM
 		(void) LSIGNAL(SIGTERM, SIG_DFL);
+#endif
+#ifdef SIGBUS
+		(void) LSIGNAL(SIGBUS, SIG_DFL);
 #endif
 	}
 }